@@ -33,6 +33,21 @@ const int NETWORK_PORT = 27016;
 #define ENABLE_DHT
 #define ENABLE_FREQUENCY
 
+// Fixed rate sampling of analog channels, requires ENABLE_ANALOG
+// #define ENABLE_ANALOG_STREAM
+
+// Interrupt based capture of pin changes, requires ENABLE_DIGITAL
+// #define ENABLE_DIGITAL_EVENTS
+
+// Oscilloscope-like capture of analog and digital channels around a trigger
+// #define ENABLE_TRIGGERED_CAPTURE
+
+// Playback of timed digital output patterns, requires ENABLE_DIGITAL
+// #define ENABLE_DIGITAL_PATTERN
+
+// Playback of waveform tables on PWM pins, requires ENABLE_ANALOG
+// #define ENABLE_WAVEFORM
+
 // Currently supported for AVR and ESP32
 #if defined (ESP32) || defined (ARDUINO_ARCH_AVR)
 #define ENABLE_SLEEP
@@ -116,6 +131,31 @@ AccelStepperFirmata accelStepper;
 Frequency frequency;
 #endif
 
+#ifdef ENABLE_ANALOG_STREAM
+#include <AnalogStreamFirmata.h>
+AnalogStreamFirmata analogStream;
+#endif
+
+#ifdef ENABLE_DIGITAL_EVENTS
+#include <DigitalEventFirmata.h>
+DigitalEventFirmata digitalEvents;
+#endif
+
+#ifdef ENABLE_TRIGGERED_CAPTURE
+#include <TriggeredCaptureFirmata.h>
+TriggeredCaptureFirmata triggeredCapture;
+#endif
+
+#ifdef ENABLE_DIGITAL_PATTERN
+#include <DigitalPatternFirmata.h>
+DigitalPatternFirmata digitalPattern;
+#endif
+
+#ifdef ENABLE_WAVEFORM
+#include <WaveformFirmata.h>
+WaveformFirmata waveform(analogOutput);
+#endif
+
 #ifdef ENABLE_BASIC_SCHEDULER
 // The scheduler allows to store scripts on the board, however this requires a kind of compiler on the client side.
 // When running dotnet/iot on the client side, prefer using the FirmataIlExecutor module instead
@@ -219,6 +259,26 @@ void initFirmata()
 	firmataExt.addFeature(frequency);
 #endif
 
+#ifdef ENABLE_ANALOG_STREAM
+	firmataExt.addFeature(analogStream);
+#endif
+
+#ifdef ENABLE_DIGITAL_EVENTS
+	firmataExt.addFeature(digitalEvents);
+#endif
+
+#ifdef ENABLE_TRIGGERED_CAPTURE
+	firmataExt.addFeature(triggeredCapture);
+#endif
+
+#ifdef ENABLE_DIGITAL_PATTERN
+	firmataExt.addFeature(digitalPattern);
+#endif
+
+#ifdef ENABLE_WAVEFORM
+	firmataExt.addFeature(waveform);
+#endif
+
 #ifdef ENABLE_SLEEP
 	firmataExt.addFeature(sleeper);
 #endif
@@ -0,0 +1,38 @@
+/*
+ * Measures how many DIGITAL_MESSAGE port writes per second DigitalOutputFirmata can apply.
+ * Upload the sketch and open the Serial Monitor at 115200 baud. Pins 2-7 are switched to outputs
+ * and toggled, so don't connect anything to them that minds.
+ */
+
+#include <ConfigurableFirmata.h>
+#include <FirmataExt.h>
+#include <DigitalOutputFirmata.h>
+
+FirmataExt firmataExt;
+DigitalOutputFirmata digitalOutput;
+
+const uint32_t ITERATIONS = 20000;
+
+void setup()
+{
+  Serial.begin(115200);
+  firmataExt.addFeature(digitalOutput);
+  for (byte pin = 2; pin < 8; pin++)
+  {
+    Firmata.setPinMode(pin, PIN_MODE_OUTPUT);
+  }
+}
+
+void loop()
+{
+  uint32_t start = micros();
+  for (uint32_t i = 0; i < ITERATIONS; i++)
+  {
+    digitalOutput.digitalWritePort(0, (i & 1) ? 0xFC : 0x00);
+  }
+  uint32_t elapsed = micros() - start;
+  Serial.print(F("digitalWritePort: "));
+  Serial.print(ITERATIONS * 1000000.0 / elapsed, 0);
+  Serial.println(F(" writes/s"));
+  delay(1000);
+}
@@ -0,0 +1,112 @@
+/*
+ * To run this test suite, you must first install the ArduinoUnit library
+ * to your Arduino/libraries/ directory.
+ * You can get ArduinoUnit here: https://github.com/mmurdoch/arduinounit
+ * Download version 2.0 or greater.
+ */
+
+#include <ArduinoUnit.h>
+#include <ConfigurableFirmata.h>
+#include <utility/SampleRingBuffer.h>
+#include <utility/AnalogSampleSource.h>
+
+void setup()
+{
+  Serial.begin(9600);
+}
+
+void loop()
+{
+  Test::run();
+}
+
+class CollectingSink : public AnalogSampleSink
+{
+  public:
+    CollectingSink()
+    {
+      frames = 0;
+      dropped = 0;
+    }
+
+    bool pushFrame(const uint16_t* values) override
+    {
+      if (frames < 16)
+      {
+        first[frames] = values[0];
+        second[frames] = values[1];
+      }
+      frames++;
+      return true;
+    }
+
+    void dropFrames(uint32_t count) override
+    {
+      dropped += count;
+    }
+
+    uint32_t frames;
+    uint32_t dropped;
+    uint16_t first[16];
+    uint16_t second[16];
+};
+
+test(ringBufferKeepsOneEntryFree)
+{
+  SampleRingBuffer<uint16_t, 8> buffer;
+  assertEqual(7, buffer.space());
+  for (uint16_t i = 0; i < 7; i++)
+  {
+    assertTrue(buffer.push(i));
+  }
+  assertFalse(buffer.push(7));
+  assertEqual(7, buffer.count());
+}
+
+test(ringBufferWrapsAround)
+{
+  SampleRingBuffer<uint16_t, 4> buffer;
+  uint16_t value;
+  for (uint16_t i = 0; i < 10; i++)
+  {
+    assertTrue(buffer.push(i));
+    assertTrue(buffer.pop(value));
+    assertEqual(i, value);
+  }
+  assertFalse(buffer.pop(value));
+}
+
+test(syntheticSourceProducesSawtooth)
+{
+  SyntheticSampleSource source;
+  CollectingSink sink;
+  byte pins[] = { 0, 1 };
+  assertTrue(source.start(pins, 2, 1000, &sink));
+  uint32_t start = millis();
+  while (sink.frames + sink.dropped < 10 && millis() - start < 100)
+  {
+    source.poll();
+  }
+  source.stop();
+  assertTrue(sink.frames + sink.dropped >= 10);
+  assertEqual(0, sink.dropped);
+  for (byte i = 0; i < 10; i++)
+  {
+    assertEqual(i, sink.first[i]);
+    assertEqual(i + 64, sink.second[i]);
+  }
+}
+
+test(loopSourceReportsMissedFrames)
+{
+  LoopSampleSource source;
+  CollectingSink sink;
+  // Digital pins, so that the test doesn't depend on the ADC of the board
+  byte pins[] = { 2 | SAMPLE_SOURCE_DIGITAL, 3 | SAMPLE_SOURCE_DIGITAL };
+  assertTrue(source.start(pins, 2, 1000, &sink));
+  delay(20);
+  source.poll();
+  source.stop();
+  assertEqual(1, sink.frames);
+  assertMoreOrEqual(sink.dropped, 19);
+}
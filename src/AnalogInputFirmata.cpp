@@ -18,9 +18,52 @@
 
 #include <ConfigurableFirmata.h>
 #include "AnalogInputFirmata.h"
+#include "Encoder7Bit.h"
 
 AnalogInputFirmata *AnalogInputFirmataInstance;
 
+#ifdef ARDUINO_PINOUT_OPTIMIZE /* ATmega328 type boards */
+/* Drive the ADC registers directly, so that an oversampling conversion (about 100us) runs while the main loop
+ * continues. The result is collected on the next pass. */
+extern uint8_t analog_reference; // set by analogReference(), from wiring_analog.c
+
+static inline void startConversion(byte pin, byte analogChannel)
+{
+  ADMUX = (analog_reference << 6) | (analogChannel & 0x07); // same as analogRead()
+  ADCSRA |= (1 << ADSC);
+}
+
+static inline bool isConversionDone()
+{
+  return !(ADCSRA & (1 << ADSC));
+}
+
+static inline int conversionResult()
+{
+  byte low = ADCL; // ADCL must be read first
+  byte high = ADCH;
+  return (high << 8) | low;
+}
+#else
+/* No generic non-blocking ADC interface available: convert a single oversampling channel per pass. */
+static int lastConversion;
+
+static inline void startConversion(byte pin, byte analogChannel)
+{
+  lastConversion = analogRead(pin);
+}
+
+static inline bool isConversionDone()
+{
+  return true;
+}
+
+static inline int conversionResult()
+{
+  return lastConversion;
+}
+#endif
+
 static int AnalogToPin(int analogChannel)
 {
     for (byte pin = 0; pin < TOTAL_PINS; pin++)
@@ -43,6 +86,18 @@ AnalogInputFirmata::AnalogInputFirmata()
 {
   AnalogInputFirmataInstance = this;
   analogInputsToReport = 0;
+  hasChannelIntervals = false;
+  frameMode = false;
+  conversionChannel = -1;
+  nextChannel = 0;
+  memset(filters, 0, sizeof(filters));
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+  {
+    deadbands[i].deadband = 0;
+    deadbands[i].lastValue = -1;
+    channelPins[i] = 0;
+    latestValues[i] = -1;
+  }
   Firmata.attach(REPORT_ANALOG, reportAnalogInputCallback);
 }
 
@@ -59,6 +114,10 @@ void AnalogInputFirmata::reportAnalog(byte analogPin, bool enable, byte physical
 	else 
 	{
         analogInputsToReport = analogInputsToReport | (1 << analogPin);
+        channelPins[analogPin] = physicalPin;
+        latestValues[analogPin] = -1;
+        filters[analogPin].count = 0;
+        filters[analogPin].sum = 0;
 		// prevent during system reset or all analog pin values will be reported
         // which may report noise for unconnected analog pins
         if (!Firmata.isResetting()) 
@@ -66,7 +125,9 @@ void AnalogInputFirmata::reportAnalog(byte analogPin, bool enable, byte physical
             // Send pin value immediately. This is helpful when connected via
             // ethernet, wi-fi or bluetooth so pin states can be known upon
             // reconnecting.
-		    Firmata.sendAnalog(analogPin, analogRead(physicalPin));
+		    int value = readBlocking(analogPin);
+		    deadbands[analogPin].lastValue = value;
+		    Firmata.sendAnalog(analogPin, value);
         }
     }
   }
@@ -111,33 +172,312 @@ boolean AnalogInputFirmata::handleSysex(byte command, byte argc, byte* argv)
   if (command == EXTENDED_REPORT_ANALOG && argc >= 2)
   {
   	byte analogChannel = argv[0];
+    if (argv[1] == ANALOG_REPORT_FILTER)
+    {
+      handleFilterConfig(analogChannel, argc - 2, argv + 2);
+      return true;
+    }
+    if (argv[1] == ANALOG_REPORT_FRAME)
+    {
+      frameMode = argc > 2 && argv[2] == 1;
+      return true;
+    }
+    if (argv[1] == ANALOG_REPORT_DEADBAND)
+    {
+      if (analogChannel < TOTAL_ANALOG_PINS && argc >= 6)
+      {
+        analog_channel_deadband& db = deadbands[analogChannel];
+        db.deadband = Firmata.decodePackedUInt14(argv + 2);
+        db.lastValue = -1;
+        db.heartbeat.setInterval(Firmata.decodePackedUInt14(argv + 4));
+      }
+      else
+      {
+        Firmata.sendString(F("Invalid analog deadband configuration"));
+      }
+      return true;
+    }
   	reportAnalog(analogChannel, argv[1] == 1, (byte)AnalogToPin(analogChannel));
 	return true;
   }
+  if (command == SAMPLING_INTERVAL && argc >= 4 && argv[2] == SAMPLING_INTERVAL_ANALOG)
+  {
+    byte analogChannel = argv[3];
+    if (analogChannel < TOTAL_ANALOG_PINS)
+    {
+      channelTimers[analogChannel].setInterval(Firmata.decodePackedUInt14(argv));
+      updateIntervalFlag();
+    }
+    return true;
+  }
+  if (command == SAMPLING_INTERVAL_QUERY && argc >= 2 && argv[0] == SAMPLING_INTERVAL_ANALOG)
+  {
+    byte analogChannel = argv[1];
+    if (analogChannel < TOTAL_ANALOG_PINS)
+    {
+      FirmataReporting::sendSamplingInterval(channelTimers[analogChannel].getInterval(), SAMPLING_INTERVAL_ANALOG, analogChannel);
+    }
+    return true;
+  }
   return false;
 }
 
+void AnalogInputFirmata::updateIntervalFlag()
+{
+  hasChannelIntervals = false;
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+  {
+    hasChannelIntervals |= channelTimers[i].getInterval() > 0;
+  }
+}
+
+void AnalogInputFirmata::handleFilterConfig(byte analogChannel, byte argc, byte* argv)
+{
+  if (analogChannel >= TOTAL_ANALOG_PINS || argc < 3)
+  {
+    Firmata.sendString(F("Invalid analog filter configuration"));
+    return;
+  }
+  byte mode = argv[0];
+  byte samples = argv[1];
+  byte extraBits = argv[2];
+  byte smoothing = argc > 3 ? argv[3] : 2;
+  if (mode > ANALOG_FILTER_EXPONENTIAL || extraBits > ANALOG_FILTER_MAX_EXTRA_BITS || smoothing > ANALOG_FILTER_MAX_SMOOTHING)
+  {
+    Firmata.sendString(F("Invalid analog filter configuration"));
+    return;
+  }
+  analog_channel_filter& filter = filters[analogChannel];
+  filter.mode = mode;
+  filter.samples = samples > 0 ? samples : 1;
+  filter.extraBits = extraBits;
+  filter.smoothing = smoothing;
+  filter.count = 0;
+  filter.sum = 0;
+  filter.average = -1;
+}
+
+/*
+ * Collects the result of the running conversion (if it is complete) and starts a conversion on the
+ * next channel whose filter still needs samples, round-robin. Channels without a filter are only
+ * converted when their report is due.
+ */
+void AnalogInputFirmata::pollConversion()
+{
+  if (conversionChannel >= 0)
+  {
+    if (!isConversionDone())
+    {
+      return;
+    }
+    storeConversion(conversionChannel, conversionResult());
+    conversionChannel = -1;
+  }
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+  {
+    byte analogChannel = nextChannel;
+    nextChannel = (nextChannel + 1) % TOTAL_ANALOG_PINS;
+    const analog_channel_filter& filter = filters[analogChannel];
+    if (filter.mode != ANALOG_FILTER_NONE && filter.count < filter.samples && isChannelReported(analogChannel))
+    {
+      conversionChannel = analogChannel;
+      startConversion(channelPins[analogChannel], analogChannel);
+      return;
+    }
+  }
+}
+
+/*
+ * Waits for the running conversion to complete and stores its result.
+ */
+void AnalogInputFirmata::finishConversion()
+{
+  if (conversionChannel >= 0)
+  {
+    while (!isConversionDone())
+    {
+    }
+    storeConversion(conversionChannel, conversionResult());
+    conversionChannel = -1;
+  }
+}
+
+void AnalogInputFirmata::storeConversion(byte analogChannel, int value)
+{
+  latestValues[analogChannel] = value;
+  analog_channel_filter& filter = filters[analogChannel];
+  // Oversample between reports, up to the configured number of conversions
+  if (filter.mode != ANALOG_FILTER_NONE && filter.count < filter.samples)
+  {
+    filter.sum += value;
+    filter.count++;
+  }
+}
+
+/*
+ * Waits for the running conversion to complete and does a blocking conversion of the given channel.
+ * Used if a value is needed before the pipeline has converted the channel.
+ */
+int AnalogInputFirmata::readBlocking(byte analogChannel)
+{
+  finishConversion();
+  latestValues[analogChannel] = analogRead(channelPins[analogChannel]);
+  return latestValues[analogChannel];
+}
+
+bool AnalogInputFirmata::isChannelReported(byte analogChannel)
+{
+  return (analogInputsToReport & (1 << analogChannel)) && Firmata.getPinMode(channelPins[analogChannel]) == PIN_MODE_ANALOG;
+}
+
+/*
+ * Returns the filtered value of the conversions collected since the last report, scaled by the configured
+ * number of extra bits, and restarts the collection.
+ */
+int32_t AnalogInputFirmata::takeFilteredValue(byte analogChannel)
+{
+  analog_channel_filter& filter = filters[analogChannel];
+  if (filter.count == 0)
+  {
+    // Reports are due faster than the pipeline converts
+    filter.sum = latestValues[analogChannel] >= 0 ? latestValues[analogChannel] : readBlocking(analogChannel);
+    filter.count = 1;
+  }
+  byte count = filter.count;
+  int32_t result;
+  if (filter.mode == ANALOG_FILTER_EXPONENTIAL)
+  {
+    int32_t mean = (int32_t)((filter.sum << 8) / count);
+    if (filter.average < 0)
+    {
+      filter.average = mean;
+    }
+    else
+    {
+      filter.average += (mean - filter.average) / (1 << filter.smoothing);
+    }
+    result = filter.average >> (8 - filter.extraBits);
+  }
+  else
+  {
+    result = (int32_t)((filter.sum << filter.extraBits) / count);
+  }
+  filter.count = 0;
+  filter.sum = 0;
+  return result;
+}
+
+/*
+ * Returns true if the value differs from the last value sent by at least the deadband of the channel,
+ * or if the heartbeat interval has expired. Updates the last value sent in that case.
+ */
+bool AnalogInputFirmata::exceedsDeadband(byte analogChannel, int32_t value, uint32_t now)
+{
+  analog_channel_deadband& db = deadbands[analogChannel];
+  if (db.deadband != 0 && db.lastValue >= 0)
+  {
+    int32_t delta = value - db.lastValue;
+    if (delta < 0)
+    {
+      delta = -delta;
+    }
+    if (delta < db.deadband && !db.heartbeat.isDue(false, now))
+    {
+      return false;
+    }
+  }
+  db.lastValue = value;
+  db.heartbeat.restart(now);
+  return true;
+}
+
+void AnalogInputFirmata::sendFrame(uint32_t timestamp, uint32_t channelMask, int32_t* values)
+{
+  byte bits = DEFAULT_ADC_RESOLUTION;
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+  {
+    if ((channelMask & (1UL << i)) && DEFAULT_ADC_RESOLUTION + filters[i].extraBits > bits)
+    {
+      bits = DEFAULT_ADC_RESOLUTION + filters[i].extraBits;
+    }
+  }
+
+  Firmata.startSysex();
+  Firmata.write(ANALOG_FRAME);
+  Firmata.sendPackedUInt32(timestamp);
+  for (byte i = 0; i < ANALOG_FRAME_MASK_BYTES; i++)
+  {
+    Firmata.write((byte)((channelMask >> (7 * i)) & 0x7F));
+  }
+  Firmata.write(bits);
+  BitStreamEncoder encoder;
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+  {
+    if (channelMask & (1UL << i))
+    {
+      encoder.write(values[i], bits);
+    }
+  }
+  encoder.flush();
+  Firmata.endSysex();
+}
+
 void AnalogInputFirmata::reset()
 {
   // by default, do not report any analog inputs
   analogInputsToReport = 0;
+  hasChannelIntervals = false;
+  memset(filters, 0, sizeof(filters));
+  frameMode = false;
+  for (byte i = 0; i < TOTAL_ANALOG_PINS; i++)
+  {
+    channelTimers[i].setInterval(0);
+    latestValues[i] = -1;
+    deadbands[i].deadband = 0;
+    deadbands[i].lastValue = -1;
+    deadbands[i].heartbeat.setInterval(0);
+  }
 }
 
 void AnalogInputFirmata::report(bool elapsed)
 {
-  if (!elapsed)
+  if (analogInputsToReport == 0)
   {
     return;
   }
+  pollConversion();
+  if (elapsed || hasChannelIntervals)
+  {
+    reportChannels(elapsed);
+  }
+}
 
-  byte pin, analogPin;
-  /* ANALOGREAD - do all analogReads() at the configured sampling interval */
-  for (pin = 0; pin < TOTAL_PINS; pin++) {
-    if (FIRMATA_IS_PIN_ANALOG(pin) && Firmata.getPinMode(pin) == PIN_MODE_ANALOG) {
-      analogPin = PIN_TO_ANALOG(pin);
-      if (analogInputsToReport & (1 << analogPin)) {
-        Firmata.sendAnalog(analogPin, analogRead(pin));
+void AnalogInputFirmata::reportChannels(bool elapsed)
+{
+  uint32_t now = millis();
+  uint32_t frameTimestamp = micros();
+  uint32_t frameMask = 0;
+  int32_t frameValues[TOTAL_ANALOG_PINS];
+  /* Report the latest conversion of each channel at its configured sampling interval */
+  for (byte analogPin = 0; analogPin < TOTAL_ANALOG_PINS; analogPin++) {
+    if (isChannelReported(analogPin) && channelTimers[analogPin].isDue(elapsed, now)) {
+      int32_t value;
+      if (filters[analogPin].mode != ANALOG_FILTER_NONE) {
+        value = takeFilteredValue(analogPin);
+      } else {
+        value = readBlocking(analogPin);
+      }
+      if (exceedsDeadband(analogPin, value, now)) {
+        if (frameMode) {
+          frameValues[analogPin] = value;
+          frameMask |= 1UL << analogPin;
+        } else {
+          Firmata.sendAnalog(analogPin, value);
+        }
       }
     }
   }
+  if (frameMask != 0) {
+    sendFrame(frameTimestamp, frameMask, frameValues);
+  }
 }
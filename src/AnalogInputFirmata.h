@@ -21,8 +21,48 @@
 #include "FirmataFeature.h"
 #include "FirmataReporting.h"
 
+// Second byte of an EXTENDED_REPORT_ANALOG message (after the channel number)
+#define ANALOG_REPORT_DISABLE       0x00
+#define ANALOG_REPORT_ENABLE        0x01
+#define ANALOG_REPORT_FILTER        0x02 // mode, samples, extra bits[, smoothing]
+#define ANALOG_REPORT_DEADBAND      0x03 // deadband (2 bytes), heartbeat interval in ms (2 bytes)
+#define ANALOG_REPORT_FRAME         0x04 // 1 to report all channels in one ANALOG_FRAME message, 0 for single messages. The channel is ignored.
+
+// An ANALOG_FRAME message contains the timestamp in microseconds (packed 32 bit), the mask of the channels included
+// (ANALOG_FRAME_MASK_BYTES 7-bit bytes, LSB first), the number of bits per value and then the values of the included
+// channels in ascending order, as a continuous bit stream (LSB first, 7 bits per byte).
+#define ANALOG_FRAME_MASK_BYTES     ((TOTAL_ANALOG_PINS + 6) / 7)
+
+// Filter modes
+#define ANALOG_FILTER_NONE          0x00 // report a single conversion
+#define ANALOG_FILTER_BOXCAR        0x01 // report the mean of the conversions since the last report
+#define ANALOG_FILTER_EXPONENTIAL   0x02 // report an exponential moving average of these means
+#define ANALOG_FILTER_MAX_EXTRA_BITS 6
+#define ANALOG_FILTER_MAX_SMOOTHING 8
+
 void reportAnalogInputCallback(byte analogPin, int value);
 
+struct analog_channel_filter {
+  byte mode;
+  byte samples;    // number of conversions to collect between two reports
+  byte extraBits;  // additional bits of resolution of the reported value
+  byte smoothing;  // exponential filter: a new mean is weighted with 1/2^smoothing
+  byte count;      // conversions collected since the last report
+  uint32_t sum;
+  int32_t average; // exponential filter state with 8 fractional bits, -1 if not initialized
+};
+
+struct analog_channel_deadband {
+  uint16_t deadband;     // minimum change to report a new value, 0 to report every value
+  int32_t lastValue;     // last value sent, -1 if none
+  ReportTimer heartbeat; // resend the last value after this time without changes, 0 = never
+};
+
+/*
+ * Channels with a filter are oversampled between reports, one conversion per pass of the main loop. On ATmega328
+ * type boards that conversion runs while the loop continues, so an analogRead() from elsewhere can get the
+ * result of the wrong channel while filters are in use.
+ */
 class AnalogInputFirmata: public FirmataFeature
 {
   public:
@@ -34,8 +74,31 @@ class AnalogInputFirmata: public FirmataFeature
     void reset();
     void report(bool elapsed) override;
   private:
+    void updateIntervalFlag();
+    void handleFilterConfig(byte analogChannel, byte argc, byte* argv);
+    int32_t takeFilteredValue(byte analogChannel);
+    void reportChannels(bool elapsed);
+    void pollConversion();
+    void finishConversion();
+    void storeConversion(byte analogChannel, int value);
+    int readBlocking(byte analogChannel);
+    bool isChannelReported(byte analogChannel);
+    bool exceedsDeadband(byte analogChannel, int32_t value, uint32_t now);
+    void sendFrame(uint32_t timestamp, uint32_t channelMask, int32_t* values);
+
     /* analog inputs */
     int analogInputsToReport; // bitwise array to store pin reporting (bit0 = A0, bit1 = A1, etc.)
+    ReportTimer channelTimers[TOTAL_ANALOG_PINS];
+    bool hasChannelIntervals; // true if any channel has its own sampling interval
+    analog_channel_filter filters[TOTAL_ANALOG_PINS];
+    analog_channel_deadband deadbands[TOTAL_ANALOG_PINS];
+    bool frameMode; // true to send all values of a pass in one ANALOG_FRAME message
+
+    /* conversion pipeline */
+    byte channelPins[TOTAL_ANALOG_PINS];     // physical pin of each channel
+    int16_t latestValues[TOTAL_ANALOG_PINS]; // latest conversion of each channel, -1 if none yet
+    signed char conversionChannel;           // channel being converted, -1 if none
+    byte nextChannel;                        // next channel to check for conversion
 };
 
 #endif
@@ -0,0 +1,267 @@
+/*
+  AnalogOutputFade.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "AnalogOutputFirmata.h"
+
+#if defined(ESP32) && defined(SOC_LEDC_SUPPORT_FADE_STOP)
+#include "driver/ledc.h"
+#define HARDWARE_FADE
+#endif
+
+// The fade curves, sampled at 17 points from 0 to 1 (scaled to 0..65535). Values in between are interpolated.
+static const uint16_t exponentialCurve[17] PROGMEM = {
+  0, 106, 257, 470, 771, 1197, 1799, 2651, 3855, 5558, 7967, 11373, 16191, 23004, 32639, 46265, 65535
+};
+static const uint16_t gammaCurve[17] PROGMEM = {
+  0, 147, 676, 1648, 3104, 5072, 7574, 10632, 14263, 18482, 23303, 28739, 34802, 41503, 48853, 56860, 65535
+};
+
+boolean AnalogOutputFirmata::handleFadeSysex(byte argc, byte* argv)
+{
+  if (argc < 1)
+  {
+    return false;
+  }
+  switch (argv[0])
+  {
+    case ANALOG_FADE_START:
+      startFade(argc, argv);
+      return true;
+    case ANALOG_FADE_STOP:
+      if (argc > 1)
+      {
+        analog_fade* fade = findFade(argv[1]);
+        if (fade != nullptr)
+        {
+          stopFade(fade);
+        }
+      }
+      return true;
+  }
+  return false;
+}
+
+void AnalogOutputFirmata::startFade(byte argc, byte* argv)
+{
+  if (argc < 12)
+  {
+    Firmata.sendString(F("Invalid fade request"));
+    return;
+  }
+  byte pin = argv[1];
+  byte curve = argv[2];
+  if (pin >= TOTAL_PINS || Firmata.getPinMode(pin) != PIN_MODE_PWM || curve > ANALOG_FADE_GAMMA)
+  {
+    Firmata.sendString(F("Fade pin is not in PWM mode or unknown curve"));
+    return;
+  }
+
+  analog_fade* fade = findFade(pin);
+  if (fade == nullptr)
+  {
+    // Take a free entry, or else one that has finished its fade
+    for (byte i = 0; i < ANALOG_FADE_MAX_CHANNELS && fade == nullptr; i++)
+    {
+      if (fades[i].pin == ANALOG_FADE_NO_PIN)
+      {
+        fade = &fades[i];
+      }
+    }
+    for (byte i = 0; i < ANALOG_FADE_MAX_CHANNELS && fade == nullptr; i++)
+    {
+      if (!fades[i].active)
+      {
+        fade = &fades[i];
+      }
+    }
+    if (fade == nullptr)
+    {
+      Firmata.sendString(F("Too many fading pins"));
+      return;
+    }
+    fade->pin = pin;
+    fade->active = false;
+    fade->value = 0;
+  }
+
+  stopFade(fade);
+  fade->curve = curve;
+  fade->flags = argv[3];
+  fade->to = (uint32_t)argv[4] | ((uint32_t)argv[5] << 7) | ((uint32_t)argv[6] << 14);
+  fade->duration = Firmata.decodePackedUInt32(argv + 7);
+  fade->from = fade->value;
+  if (argc >= 15)
+  {
+    fade->from = (uint32_t)argv[12] | ((uint32_t)argv[13] << 7) | ((uint32_t)argv[14] << 14);
+  }
+  fade->startTime = millis();
+  fade->hardware = curve == ANALOG_FADE_LINEAR && startHardwareFade(fade);
+  if (!fade->hardware)
+  {
+    analogWriteInternal(pin, fade->from);
+  }
+  fade->value = fade->from;
+  fade->active = true;
+}
+
+analog_fade* AnalogOutputFirmata::findFade(byte pin)
+{
+  for (byte i = 0; i < ANALOG_FADE_MAX_CHANNELS; i++)
+  {
+    if (fades[i].pin == pin)
+    {
+      return &fades[i];
+    }
+  }
+  return nullptr;
+}
+
+void AnalogOutputFirmata::stopFade(analog_fade* fade)
+{
+  if (fade->active && fade->hardware)
+  {
+    stopHardwareFade(fade);
+  }
+  fade->active = false;
+}
+
+void AnalogOutputFirmata::releaseFade(byte pin)
+{
+  analog_fade* fade = findFade(pin);
+  if (fade != nullptr)
+  {
+    stopFade(fade);
+    fade->pin = ANALOG_FADE_NO_PIN;
+  }
+}
+
+void AnalogOutputFirmata::resetFades()
+{
+  for (byte i = 0; i < ANALOG_FADE_MAX_CHANNELS; i++)
+  {
+    if (fades[i].pin != ANALOG_FADE_NO_PIN)
+    {
+      stopFade(&fades[i]);
+    }
+    fades[i].pin = ANALOG_FADE_NO_PIN;
+    fades[i].active = false;
+  }
+}
+
+/*
+ * Returns the duty of the fade after the given number of milliseconds.
+ * A falling fade uses the curve mirrored, so that it also changes slowly at low duty.
+ */
+uint32_t AnalogOutputFirmata::fadeValue(const analog_fade* fade, uint32_t elapsed)
+{
+  if (elapsed >= fade->duration)
+  {
+    return fade->to;
+  }
+  bool falling = fade->to < fade->from;
+  uint32_t position = (uint32_t)(((uint64_t)elapsed << 16) / fade->duration); // 0..65535
+  if (fade->curve != ANALOG_FADE_LINEAR)
+  {
+    const uint16_t* curve = fade->curve == ANALOG_FADE_EXPONENTIAL ? exponentialCurve : gammaCurve;
+    uint32_t x = falling ? 65535 - position : position;
+    byte index = x >> 12;
+    uint32_t a = pgm_read_word(curve + index);
+    uint32_t b = pgm_read_word(curve + index + 1);
+    position = a + (((b - a) * (x & 0xFFF)) >> 12);
+    if (falling)
+    {
+      position = 65535 - position;
+    }
+  }
+  uint32_t delta = falling ? fade->from - fade->to : fade->to - fade->from;
+  uint32_t step = (uint32_t)(((uint64_t)delta * position) >> 16);
+  return falling ? fade->from - step : fade->from + step;
+}
+
+#ifdef HARDWARE_FADE
+
+bool AnalogOutputFirmata::startHardwareFade(analog_fade* fade)
+{
+  if (fade->duration == 0 || fade->duration > INT32_MAX)
+  {
+    return false;
+  }
+  return ledcFade(fade->pin, fade->from, fade->to, (int)fade->duration);
+}
+
+void AnalogOutputFirmata::stopHardwareFade(analog_fade* fade)
+{
+  // ledcWrite() would wait until the fade has finished
+  ledc_channel_handle_t* bus = (ledc_channel_handle_t*)perimanGetPinBus(fade->pin, ESP32_BUS_TYPE_LEDC);
+  if (bus != nullptr)
+  {
+    ledc_fade_stop((ledc_mode_t)(bus->channel / SOC_LEDC_CHANNEL_NUM), (ledc_channel_t)(bus->channel % SOC_LEDC_CHANNEL_NUM));
+  }
+  fade->value = ledcRead(fade->pin);
+}
+
+#else
+
+bool AnalogOutputFirmata::startHardwareFade(analog_fade* fade)
+{
+  return false;
+}
+
+void AnalogOutputFirmata::stopHardwareFade(analog_fade* fade)
+{
+}
+
+#endif
+
+void AnalogOutputFirmata::sendFadeDone(const analog_fade* fade)
+{
+  Firmata.startSysex();
+  Firmata.write(ANALOG_FADE_DATA);
+  Firmata.write(ANALOG_FADE_DONE);
+  Firmata.write(fade->pin);
+  Firmata.write((byte)(fade->value & 0x7F));
+  Firmata.write((byte)((fade->value >> 7) & 0x7F));
+  Firmata.write((byte)((fade->value >> 14) & 0x7F));
+  Firmata.endSysex();
+}
+
+void AnalogOutputFirmata::report(bool elapsed)
+{
+  uint32_t now = millis();
+  for (byte i = 0; i < ANALOG_FADE_MAX_CHANNELS; i++)
+  {
+    analog_fade* fade = &fades[i];
+    if (!fade->active)
+    {
+      continue;
+    }
+    uint32_t time = now - fade->startTime;
+    if (!fade->hardware)
+    {
+      uint32_t value = fadeValue(fade, time);
+      if (value != fade->value)
+      {
+        analogWriteInternal(fade->pin, value);
+        fade->value = value;
+      }
+    }
+    if (time >= fade->duration)
+    {
+      fade->active = false;
+      fade->value = fade->to;
+      if (fade->flags & ANALOG_FADE_NOTIFY)
+      {
+        sendFadeDone(fade);
+      }
+    }
+  }
+}
@@ -21,12 +21,27 @@
 
 #ifndef ESP32
 
+#if defined(__AVR_ATmega328P__) || defined(__AVR_ATmega328__) || defined(__AVR_ATmega168__)
+#define PWM_TIMER_PRESCALERS
+// The core runs Timer1 and Timer2 in 8 bit phase correct mode, so the PWM frequency is F_CPU / 510 / prescaler.
+// The clock select bits are the index into the tables plus one.
+static const uint16_t timer1Prescalers[] = { 1, 8, 64, 256, 1024 };
+static const uint16_t timer2Prescalers[] = { 1, 8, 32, 64, 128, 256, 1024 };
+#endif
+
 AnalogOutputFirmata::AnalogOutputFirmata()
 {
+    resetFades();
 }
 
 void AnalogOutputFirmata::reset()
 {
+    resetFades();
+#ifdef PWM_TIMER_PRESCALERS
+    // Back to the prescaler set by the core
+    TCCR1B = (TCCR1B & ~0x07) | 3;
+    TCCR2B = (TCCR2B & ~0x07) | 4;
+#endif
 }
 
 
@@ -38,6 +53,7 @@ void AnalogOutputFirmata::setupPwmPin(byte pin)
 
 boolean AnalogOutputFirmata::handlePinMode(byte pin, int mode)
 {
+    releaseFade(pin);
     if (mode == PIN_MODE_PWM && FIRMATA_IS_PIN_PWM(pin)) {
         setupPwmPin(pin);
         return true;
@@ -58,6 +74,113 @@ void AnalogOutputFirmata::analogWriteInternal(byte pin, uint32_t value)
     analogWrite(pin, (int)value);
 }
 
+#ifdef PWM_TIMER_PRESCALERS
+
+/*
+ * Returns the clock select bits of the prescaler giving the frequency closest to the requested one
+ */
+static byte closestPrescaler(const uint16_t* prescalers, byte count, uint32_t frequency)
+{
+    byte best = 0;
+    uint32_t bestError = UINT32_MAX;
+    for (byte i = 0; i < count; i++)
+    {
+        uint32_t f = F_CPU / 510 / prescalers[i];
+        uint32_t error = f > frequency ? f - frequency : frequency - f;
+        if (error < bestError)
+        {
+            best = i;
+            bestError = error;
+        }
+    }
+    return best + 1;
+}
+
+static uint32_t timerFrequency(const uint16_t* prescalers, byte count, byte clockSelect)
+{
+    if (clockSelect == 0 || clockSelect > count)
+    {
+        return 0; // stopped or external clock
+    }
+    return F_CPU / 510 / prescalers[clockSelect - 1];
+}
+
+bool AnalogOutputFirmata::handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value)
+{
+    // 104: PWM frequency in Hz, 105: PWM resolution in bits
+    if (variable_id != 104 && variable_id != 105)
+    {
+        return false;
+    }
+    *data_type = SystemVariableDataType::Int;
+    if (pin >= TOTAL_PINS || !FIRMATA_IS_PIN_PWM(pin))
+    {
+        *status = SystemVariableError::Error;
+        Firmata.sendString(F("Not a PWM pin"));
+        return true;
+    }
+    *status = SystemVariableError::NoError;
+    if (variable_id == 105)
+    {
+        if (write && *value != 8)
+        {
+            *status = SystemVariableError::Error;
+            Firmata.sendString(F("PWM resolution not supported"));
+        }
+        *value = 8;
+        return true;
+    }
+
+    bool timer1 = pin == 9 || pin == 10;
+    bool timer2 = pin == 3 || pin == 11;
+    if (write)
+    {
+        uint32_t frequency = *value < 1 ? 1 : (uint32_t)*value;
+        bool servos = false;
+        for (byte i = 0; i < TOTAL_PINS; i++)
+        {
+            servos |= Firmata.getPinMode(i) == PIN_MODE_SERVO;
+        }
+        if (timer1 && !servos)
+        {
+            TCCR1B = (TCCR1B & ~0x07) | closestPrescaler(timer1Prescalers, 5, frequency);
+        }
+        else if (timer2)
+        {
+            TCCR2B = (TCCR2B & ~0x07) | closestPrescaler(timer2Prescalers, 7, frequency);
+        }
+        else
+        {
+            // Timer0 also runs millis(), and the Servo library uses Timer1
+            *status = SystemVariableError::Error;
+            Firmata.sendString(F("PWM frequency of this pin can't be changed"));
+        }
+    }
+    if (timer1)
+    {
+        *value = timerFrequency(timer1Prescalers, 5, TCCR1B & 0x07);
+    }
+    else if (timer2)
+    {
+        *value = timerFrequency(timer2Prescalers, 7, TCCR2B & 0x07);
+    }
+    else
+    {
+        *value = F_CPU / 256 / 64; // Timer0, fast PWM
+    }
+    return true;
+}
+
+#else
+
+bool AnalogOutputFirmata::handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value)
+{
+    // The PWM frequency and resolution can't be changed at runtime on this board
+    return false;
+}
+
+#endif
+
 
 #endif /* NOT ESP32 */
 
@@ -20,6 +20,56 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 
+// Subcommands of ANALOG_FADE_DATA
+#define ANALOG_FADE_START 0x00 // pin, curve, flags, target duty (3 bytes), duration in milliseconds (packed 32 bit),
+                               // optionally the start duty (3 bytes). Without it, the fade starts from the duty the
+                               // last fade or EXTENDED_ANALOG message left on the pin, or from 0 if not known.
+#define ANALOG_FADE_STOP  0x01 // pin. The pin keeps its current duty.
+#define ANALOG_FADE_DONE  0x02 // reply: pin, duty (3 bytes). Sent when a fade with ANALOG_FADE_NOTIFY has reached its target.
+
+// Fade curves
+#define ANALOG_FADE_LINEAR      0x00
+#define ANALOG_FADE_EXPONENTIAL 0x01 // 2^(8t), looks linear to the eye when dimming LEDs
+#define ANALOG_FADE_GAMMA       0x02 // t^2.2
+
+// Fade flags
+#define ANALOG_FADE_NOTIFY      0x01
+
+// Number of pins that can fade at the same time
+#ifndef ANALOG_FADE_MAX_CHANNELS
+#ifdef LARGE_MEM_DEVICE
+#define ANALOG_FADE_MAX_CHANNELS 16
+#else
+#define ANALOG_FADE_MAX_CHANNELS 4
+#endif
+#endif
+#define ANALOG_FADE_NO_PIN 0xFF
+
+struct analog_fade {
+  byte pin;            // ANALOG_FADE_NO_PIN if the entry is free
+  byte curve;
+  byte flags;
+  bool active;
+  bool hardware;       // the LEDC peripheral of the ESP32 runs the fade
+  uint32_t from;
+  uint32_t to;
+  uint32_t value;      // last written duty
+  uint32_t startTime;  // millis()
+  uint32_t duration;
+};
+
+/*
+ * Writes PWM values. Besides EXTENDED_ANALOG (and ANALOG_MESSAGE) this supports fading a pin
+ * to a target duty on the device with ANALOG_FADE_DATA. The fades are interpolated from the main loop.
+ * On the ESP32, linear fades are done by the LEDC hardware.
+ *
+ * The PWM frequency and resolution of a pin are set with SYSTEM_VARIABLE 104 (frequency in Hz) and 105 (resolution
+ * in bits). The reply contains the effective setting. CAPABILITY_RESPONSE reports the resolution of each pin.
+ * On the ESP32 they are set per pin. Two LEDC channels share a timer, so a change is refused while the other pin on
+ * that timer is in PWM mode with another setting, and a pin that is attached next to it takes over its setting.
+ * On the ATmega328/168, the frequency of the pins of Timer1 (9, 10) and Timer2 (3, 11) is selected from the timer
+ * prescalers and the resolution is fixed at 8 bits. Timer0 (pins 5, 6) runs millis().
+ */
 class AnalogOutputFirmata: public FirmataFeature
 {
   public:
@@ -27,9 +77,30 @@ class AnalogOutputFirmata: public FirmataFeature
     void handleCapability(byte pin);
     boolean handlePinMode(byte pin, int mode);
     void reset();
+    void report(bool elapsed) override;
+    bool handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value) override;
     void analogWriteInternal(byte pin, uint32_t value);
   private:
       void setupPwmPin(byte pin);
+      boolean handleFadeSysex(byte argc, byte* argv);
+      void startFade(byte argc, byte* argv);
+      analog_fade* findFade(byte pin);
+      void stopFade(analog_fade* fade);
+      void releaseFade(byte pin);
+      void resetFades();
+      uint32_t fadeValue(const analog_fade* fade, uint32_t elapsed);
+      bool startHardwareFade(analog_fade* fade);
+      void stopHardwareFade(analog_fade* fade);
+      void sendFadeDone(const analog_fade* fade);
+
+      analog_fade fades[ANALOG_FADE_MAX_CHANNELS];
+#ifdef ESP32
+      bool setPwmConfig(byte pin, uint32_t frequency, byte resolution);
+      int pwmTimerPartner(byte pin);
+      bool isPwmTimerShared(byte pin, uint32_t frequency, byte resolution);
+      uint32_t pwmFrequency[TOTAL_PINS];
+      byte pwmResolution[TOTAL_PINS];
+#endif
 	boolean handleSysex(byte command, byte argc, byte* argv)
 	{
 		if (command == EXTENDED_ANALOG) 
@@ -43,11 +114,23 @@ class AnalogOutputFirmata: public FirmataFeature
 				byte mode = Firmata.getPinMode(pin);
 				if (mode == PIN_MODE_ANALOG || mode == PIN_MODE_PWM)
 				{
+					analog_fade* fade = findFade(pin);
+					if (fade != nullptr)
+					{
+						// A direct write ends a running fade
+						stopFade(fade);
+						fade->value = val;
+					}
 					analogWriteInternal(argv[0], val);
 				}
-				return true;
+				// Servo positions are written by ServoFirmata
+				return mode != PIN_MODE_SERVO;
 			}
 		}
+		else if (command == ANALOG_FADE_DATA)
+		{
+			return handleFadeSysex(argc, argv);
+		}
 
 	  return false;
 	}
@@ -22,42 +22,67 @@
 
 #define LEDC_BASE_FREQ 5000
 #define MAX_PWM_CHANNELS 16
+#define LEDC_SOURCE_CLOCK 80000000 // APB clock, frequency * 2^resolution must not exceed it
+#ifndef SOC_LEDC_TIMER_BIT_WIDTH
+#define SOC_LEDC_TIMER_BIT_WIDTH 14
+#endif
 
 
 AnalogOutputFirmata::AnalogOutputFirmata()
 {
+    resetFades();
+    for (int i = 0; i < TOTAL_PINS; i++)
+    {
+        pwmFrequency[i] = LEDC_BASE_FREQ;
+        pwmResolution[i] = DEFAULT_PWM_RESOLUTION;
+    }
 }
 
 void AnalogOutputFirmata::reset()
 {
+    resetFades();
     for (int i = 0; i < TOTAL_PINS; i++)
     {
         if (Firmata.getPinMode(i) == PIN_MODE_PWM)
         {
             ledcDetach(i);
         }
+        pwmFrequency[i] = LEDC_BASE_FREQ;
+        pwmResolution[i] = DEFAULT_PWM_RESOLUTION;
     }
 }
 
 
 void AnalogOutputFirmata::analogWriteInternal(uint8_t pin, uint32_t value) {
-    // calculate duty, 8191 from 2 ^ 13 - 1
-    uint32_t valueMax = (1 << DEFAULT_PWM_RESOLUTION) - 1;
+    uint32_t valueMax = (1 << pwmResolution[pin]) - 1;
     uint32_t duty = min(value, valueMax);
     ledcWrite(pin, duty);
 }
 
 void AnalogOutputFirmata::setupPwmPin(byte pin) {
 
-    if (!ledcAttach(pin, LEDC_BASE_FREQ, DEFAULT_PWM_RESOLUTION))
+    if (!ledcAttach(pin, pwmFrequency[pin], pwmResolution[pin]))
     {
         Firmata.sendStringf(F("Warning: Pin %d could not be configured for PWM (too many channels?)"), pin);
+    }
+    else
+    {
+        int other = pwmTimerPartner(pin);
+        if (other >= 0 && (pwmFrequency[other] != pwmFrequency[pin] || pwmResolution[other] != pwmResolution[pin]))
+        {
+            // Attaching has set up the shared timer for this pin, set it back for the other pin
+            pwmFrequency[pin] = pwmFrequency[other];
+            pwmResolution[pin] = pwmResolution[other];
+            ledcChangeFrequency(pin, pwmFrequency[pin], pwmResolution[pin]);
+            Firmata.sendStringf(F("Pin %d shares the PWM timer with pin %d, using its frequency and resolution"), pin, other);
+        }
     }
 	ledcWrite(pin, 0);
 }
 
 boolean AnalogOutputFirmata::handlePinMode(byte pin, int mode)
 {
+    releaseFade(pin);
     if (mode == PIN_MODE_PWM && FIRMATA_IS_PIN_PWM(pin)) {
         setupPwmPin(pin);
         return true;
@@ -76,8 +101,120 @@ void AnalogOutputFirmata::handleCapability(byte pin)
 {
   if (FIRMATA_IS_PIN_PWM(pin)) {
     Firmata.write(PIN_MODE_PWM);
-    Firmata.write(DEFAULT_PWM_RESOLUTION);
+    Firmata.write(pwmResolution[pin]);
   }
 }
 
+/*
+ * Returns the other PWM pin that uses the LEDC timer of the pin, or -1 if none.
+ * Two neighbouring channels use the same timer, so changing it changes that pin too.
+ */
+int AnalogOutputFirmata::pwmTimerPartner(byte pin)
+{
+    ledc_channel_handle_t* bus = (ledc_channel_handle_t*)perimanGetPinBus(pin, ESP32_BUS_TYPE_LEDC);
+    if (bus == nullptr)
+    {
+        return -1;
+    }
+    for (byte other = 0; other < TOTAL_PINS; other++)
+    {
+        if (other == pin || Firmata.getPinMode(other) != PIN_MODE_PWM)
+        {
+            continue;
+        }
+        ledc_channel_handle_t* otherBus = (ledc_channel_handle_t*)perimanGetPinBus(other, ESP32_BUS_TYPE_LEDC);
+        if (otherBus != nullptr && otherBus->channel / 2 == bus->channel / 2)
+        {
+            return other;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns true if another PWM pin shares the LEDC timer of the pin and has a different configuration.
+ */
+bool AnalogOutputFirmata::isPwmTimerShared(byte pin, uint32_t frequency, byte resolution)
+{
+    int other = pwmTimerPartner(pin);
+    return other >= 0 && (pwmFrequency[other] != frequency || pwmResolution[other] != resolution);
+}
+
+bool AnalogOutputFirmata::setPwmConfig(byte pin, uint32_t frequency, byte resolution)
+{
+    if (resolution < 1 || resolution > SOC_LEDC_TIMER_BIT_WIDTH || frequency == 0 ||
+        ((uint64_t)frequency << resolution) > LEDC_SOURCE_CLOCK)
+    {
+        Firmata.sendString(F("PWM frequency or resolution not supported"));
+        return false;
+    }
+    if (Firmata.getPinMode(pin) == PIN_MODE_PWM)
+    {
+        if (isPwmTimerShared(pin, frequency, resolution))
+        {
+            Firmata.sendString(F("PWM timer is shared with another pin"));
+            return false;
+        }
+        analog_fade* fade = findFade(pin);
+        if (fade != nullptr)
+        {
+            stopFade(fade);
+        }
+        frequency = ledcChangeFrequency(pin, frequency, resolution);
+        if (frequency == 0)
+        {
+            Firmata.sendString(F("PWM frequency or resolution not supported"));
+            return false;
+        }
+        if (resolution != pwmResolution[pin])
+        {
+            // The duty would mean something else now
+            ledcWrite(pin, 0);
+            if (fade != nullptr)
+            {
+                fade->value = 0;
+            }
+        }
+    }
+    pwmFrequency[pin] = frequency;
+    pwmResolution[pin] = resolution;
+    return true;
+}
+
+bool AnalogOutputFirmata::handleSystemVariableQuery(bool write, SystemVariableDataType* data_type, int variable_id, byte pin, SystemVariableError* status, int* value)
+{
+    // 104: PWM frequency in Hz, 105: PWM resolution in bits
+    if (variable_id != 104 && variable_id != 105)
+    {
+        return false;
+    }
+    *data_type = SystemVariableDataType::Int;
+    if (pin >= TOTAL_PINS || !FIRMATA_IS_PIN_PWM(pin))
+    {
+        *status = SystemVariableError::Error;
+        Firmata.sendString(F("Not a PWM pin"));
+        return true;
+    }
+    *status = SystemVariableError::NoError;
+    if (write)
+    {
+        uint32_t frequency = pwmFrequency[pin];
+        byte resolution = pwmResolution[pin];
+        if (variable_id == 104)
+        {
+            frequency = *value < 0 ? 0 : (uint32_t)*value;
+        }
+        else
+        {
+            resolution = *value < 0 || *value > 32 ? 0 : (byte)*value;
+        }
+        if (!setPwmConfig(pin, frequency, resolution))
+        {
+            *status = SystemVariableError::Error;
+        }
+    }
+    *value = variable_id == 104 ? (int)pwmFrequency[pin] : pwmResolution[pin];
+    return true;
+}
+
 #endif
@@ -0,0 +1,213 @@
+/*
+  AnalogStreamFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "AnalogStreamFirmata.h"
+#include "Encoder7Bit.h"
+
+AnalogStreamFirmata::AnalogStreamFirmata()
+{
+  source = &defaultSource;
+  running = false;
+  numChannels = 0;
+  blockFrames = 0;
+  framesPerSecond = 0;
+  startTime = 0;
+  nextFrame = 0;
+  sequence = 0;
+  overrun = false;
+  lostFrames = 0;
+}
+
+AnalogStreamFirmata::AnalogStreamFirmata(AnalogSampleSource* source)
+  : AnalogStreamFirmata()
+{
+  this->source = source;
+}
+
+void AnalogStreamFirmata::handleCapability(byte pin)
+{
+  // The pins are used in PIN_MODE_ANALOG, which is reported by AnalogInputFirmata
+}
+
+boolean AnalogStreamFirmata::handlePinMode(byte pin, int mode)
+{
+  return false;
+}
+
+boolean AnalogStreamFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != ANALOG_STREAM_DATA || argc < 1)
+  {
+    return false;
+  }
+  switch (argv[0])
+  {
+    case ANALOG_STREAM_START:
+      startStream(argc, argv);
+      return true;
+    case ANALOG_STREAM_STOP:
+      stopStream();
+      return true;
+  }
+  return false;
+}
+
+void AnalogStreamFirmata::startStream(byte argc, byte* argv)
+{
+  if (argc < 9 || argc - 8 > ANALOG_SAMPLE_SOURCE_MAX_CHANNELS)
+  {
+    Firmata.sendString(F("Invalid analog stream request"));
+    return;
+  }
+  stopStream();
+
+  byte channels = argc - 8;
+  byte pins[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+  for (byte ch = 0; ch < channels; ch++)
+  {
+    byte pin = 0;
+    while (pin < TOTAL_PINS && !(FIRMATA_IS_PIN_ANALOG(pin) && PIN_TO_ANALOG(pin) == argv[8 + ch]))
+    {
+      pin++;
+    }
+    if (pin == TOTAL_PINS || Firmata.getPinMode(pin) != PIN_MODE_ANALOG)
+    {
+      Firmata.sendString(F("Analog stream channel is not in analog mode"));
+      return;
+    }
+    pins[ch] = pin;
+  }
+
+  framesPerSecond = Firmata.decodePackedUInt32(argv + 1);
+  blockFrames = Firmata.decodePackedUInt14(argv + 6);
+  // A block must fit into the buffer, one entry of the buffer is always free
+  uint16_t maxFrames = (ANALOG_STREAM_BUFFER_SIZE - 1) / channels;
+  if (blockFrames == 0 || blockFrames > maxFrames)
+  {
+    blockFrames = maxFrames;
+  }
+  numChannels = channels;
+  buffer.clear();
+  nextFrame = 0;
+  sequence = 0;
+  overrun = false;
+  lostFrames = 0;
+  startTime = micros();
+  running = source->start(pins, numChannels, framesPerSecond, this);
+  if (!running)
+  {
+    Firmata.sendString(F("Analog stream rate not supported"));
+  }
+}
+
+void AnalogStreamFirmata::stopStream()
+{
+  if (running)
+  {
+    source->stop();
+    running = false;
+  }
+}
+
+bool AnalogStreamFirmata::pushFrame(const uint16_t* values)
+{
+  // After an overrun, no frames are stored until the main loop has reported it
+  if (overrun || buffer.space() < numChannels)
+  {
+    return false;
+  }
+  for (byte ch = 0; ch < numChannels; ch++)
+  {
+    buffer.push(values[ch]);
+  }
+  return true;
+}
+
+void AnalogStreamFirmata::dropFrames(uint32_t count)
+{
+  lostFrames += count;
+  overrun = true;
+}
+
+void AnalogStreamFirmata::sendBlock(uint16_t frames)
+{
+  uint32_t timestamp = startTime + (uint32_t)((uint64_t)nextFrame * 1000000 / framesPerSecond);
+  Firmata.startSysex();
+  Firmata.write(ANALOG_STREAM_DATA);
+  Firmata.write(ANALOG_STREAM_BLOCK);
+  Firmata.sendPackedUInt14(sequence);
+  Firmata.sendPackedUInt32(nextFrame);
+  Firmata.sendPackedUInt32(timestamp);
+  Firmata.sendPackedUInt14(frames);
+  Firmata.write(DEFAULT_ADC_RESOLUTION);
+  Firmata.write(numChannels);
+  BitStreamEncoder encoder;
+  uint16_t samples = frames * numChannels;
+  for (uint16_t i = 0; i < samples; i++)
+  {
+    uint16_t value = 0;
+    buffer.pop(value);
+    encoder.write(value, DEFAULT_ADC_RESOLUTION);
+  }
+  encoder.flush();
+  Firmata.endSysex();
+  sequence = (sequence + 1) & 0x3FFF;
+  nextFrame += frames;
+}
+
+void AnalogStreamFirmata::sendOverrun(uint32_t lost)
+{
+  Firmata.startSysex();
+  Firmata.write(ANALOG_STREAM_DATA);
+  Firmata.write(ANALOG_STREAM_OVERRUN);
+  Firmata.sendPackedUInt32(lost);
+  Firmata.endSysex();
+}
+
+void AnalogStreamFirmata::report(bool elapsed)
+{
+  if (!running)
+  {
+    return;
+  }
+  source->poll();
+
+  while (buffer.count() >= blockFrames * numChannels)
+  {
+    sendBlock(blockFrames);
+  }
+  if (!overrun)
+  {
+    return;
+  }
+
+  // The producer doesn't add frames while the overrun flag is set, so we can send
+  // what's left in the buffer and then continue after the gap.
+  uint16_t frames = buffer.count() / numChannels;
+  if (frames > 0)
+  {
+    sendBlock(frames);
+  }
+  noInterrupts();
+  uint32_t lost = lostFrames;
+  lostFrames = 0;
+  overrun = false;
+  interrupts();
+  sendOverrun(lost);
+  nextFrame += lost;
+}
+
+void AnalogStreamFirmata::reset()
+{
+  stopStream();
+  buffer.clear();
+}
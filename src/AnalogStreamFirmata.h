@@ -0,0 +1,79 @@
+/*
+  AnalogStreamFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef AnalogStreamFirmata_h
+#define AnalogStreamFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "utility/AnalogSampleSource.h"
+#include "utility/SampleRingBuffer.h"
+
+// Subcommands of ANALOG_STREAM_DATA
+#define ANALOG_STREAM_START   0x00 // frames per second (packed 32 bit), frames per block (2 bytes), analog channels (1 byte each)
+#define ANALOG_STREAM_STOP    0x01
+#define ANALOG_STREAM_BLOCK   0x02 // reply: sequence number (2 bytes), index of the first frame (packed 32 bit), its timestamp
+                                   // in microseconds (packed 32 bit), number of frames (2 bytes), bits per sample, number of
+                                   // channels, then the samples frame by frame as a continuous bit stream (LSB first, 7 bits per byte)
+#define ANALOG_STREAM_OVERRUN 0x03 // reply: number of frames lost (packed 32 bit). The next block continues after the gap.
+
+// Size of the sample buffer, in samples (not frames)
+#ifdef LARGE_MEM_DEVICE
+#define ANALOG_STREAM_BUFFER_SIZE 2048
+#else
+#define ANALOG_STREAM_BUFFER_SIZE 128
+#endif
+
+/*
+ * Samples a set of analog channels with a fixed rate and sends the samples in blocks.
+ * The samples are produced by an AnalogSampleSource (on the ESP32 the DMA of the continuous ADC driver,
+ * otherwise a source that samples from the main loop) and go through a lock-free ring buffer.
+ * When the buffer is full, sampling pauses until the buffer has been sent and the number of lost
+ * frames has been reported with ANALOG_STREAM_OVERRUN.
+ * Note: On AVR, don't report analog channels with AnalogInputFirmata while streaming, both use the same ADC.
+ * On the ESP32, only ADC1 pins can be streamed, and analogRead() of ADC1 pins fails while streaming.
+ */
+class AnalogStreamFirmata: public FirmataFeature, public AnalogSampleSink
+{
+  public:
+    AnalogStreamFirmata();
+    /* Use another sample source (e.g. a SyntheticSampleSource for tests) */
+    AnalogStreamFirmata(AnalogSampleSource* source);
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    void reset() override;
+    void report(bool elapsed) override;
+
+    bool pushFrame(const uint16_t* values) override;
+    void dropFrames(uint32_t count) override;
+
+  private:
+    void startStream(byte argc, byte* argv);
+    void stopStream();
+    void sendBlock(uint16_t frames);
+    void sendOverrun(uint32_t lostFrames);
+
+    DefaultAnalogSampleSource defaultSource;
+    AnalogSampleSource* source;
+    SampleRingBuffer<uint16_t, ANALOG_STREAM_BUFFER_SIZE> buffer;
+    bool running;
+    byte numChannels;
+    uint16_t blockFrames;
+    uint32_t framesPerSecond;
+    uint32_t startTime;   // micros() at frame 0
+    uint32_t nextFrame;   // index of the next frame taken from the buffer
+    uint16_t sequence;    // of the next block
+    volatile bool overrun;
+    volatile uint32_t lostFrames;
+};
+
+#endif
@@ -444,15 +444,15 @@ boolean FirmataClass::isResetting(void)
 /**
  * Send an analog message to the Firmata host application. The range of pins is limited to [0..15]
  * when using the ANALOG_MESSAGE. The maximum value of the ANALOG_MESSAGE is limited to 14 bits
- * (16384). To increase the pin range or value, see the documentation for the EXTENDED_ANALOG
- * message.
- * @param analogChannel The analog pin to send the value of (limited to pins 0 - 15).
+ * (16384). Larger pin numbers or values are sent using an EXTENDED_ANALOG message.
+ * @param analogChannel The analog pin to send the value of.
  * @param value The value of the analog pin (0 - 1024 for 10-bit analog, 0 - 4096 for 12-bit, etc).
- * The maximum value is 14-bits (16384).
+ * The maximum value is 21-bits.
  */
-void FirmataClass::sendAnalog(byte analogPin, int value)
+void FirmataClass::sendAnalog(byte analogPin, uint32_t value)
 {
-    if (analogPin <= 15)
+    sendTimestampIfDue();
+    if (analogPin <= 15 && value < 0x4000)
     {
         // pin can only be 0-15, so chop higher bits
         FirmataStream->write(ANALOG_MESSAGE | (analogPin & 0xF));
@@ -464,6 +464,10 @@ void FirmataClass::sendAnalog(byte analogPin, int value)
         FirmataStream->write(EXTENDED_ANALOG);
         FirmataStream->write(analogPin);
         sendValueAsTwo7bitBytes(value);
+        if (value >= 0x4000)
+        {
+            FirmataStream->write((byte)((value >> 14) & 0x7F));
+        }
         endSysex();
     }
 }
@@ -506,6 +510,7 @@ void FirmataClass::sendDigital(byte pin, int value)
  */
 void FirmataClass::sendDigitalPort(byte portNumber, int portData)
 {
+    sendTimestampIfDue();
     byte msg[3];
     msg[0] = (DIGITAL_MESSAGE | (portNumber & 0xF));
     msg[1] = ((byte)portData % 128); // Tx bits 0-6
@@ -513,6 +518,46 @@ void FirmataClass::sendDigitalPort(byte portNumber, int portData)
     FirmataStream->write(msg, 3);
 }
 
+/**
+ * Send a REPORT_TIMESTAMP message with the current device time in microseconds, if timestamps are
+ * enabled and the last timestamp is older than the timestamp resolution. Call this before sending
+ * a message that reports input data. The host assigns the latest timestamp to all following reports.
+ * The timestamp wraps around after about 71 minutes.
+ */
+void FirmataClass::sendTimestampIfDue()
+{
+    if (timestampResolution == 0)
+    {
+        return;
+    }
+    uint32_t now = micros();
+    if (timestampSent && now - lastTimestamp < timestampResolution)
+    {
+        return;
+    }
+    lastTimestamp = now;
+    timestampSent = true;
+    startSysex();
+    FirmataStream->write(REPORT_TIMESTAMP);
+    sendPackedUInt32(now);
+    endSysex();
+}
+
+/**
+ * Enables timestamps for report messages.
+ * @param microseconds The minimum time between two timestamps, 0 to disable timestamps.
+ */
+void FirmataClass::setTimestampResolution(uint32_t microseconds)
+{
+    timestampResolution = microseconds;
+    timestampSent = false;
+}
+
+uint32_t FirmataClass::getTimestampResolution()
+{
+    return timestampResolution;
+}
+
 /**
  * Send a sysex message where all values after the command byte are packet as 2 7-bit bytes
  * (this is not always the case so this function is not always used to send sysex messages).
@@ -891,6 +936,9 @@ void FirmataClass::systemReset(void)
   parsingSysex = false;
   sysexBytesRead = 0;
 
+  timestampResolution = 0;
+  timestampSent = false;
+
   if (currentSystemResetCallback)
     (*currentSystemResetCallback)();
 
@@ -64,6 +64,17 @@
 
 // extended command set using sysex (0-127/0x00-0x7F)
 /* 0x00-0x0F reserved for user-defined commands */
+#define I2C_TRANSACTION         0x55 // run a list of i2c operations, reply with the status of each and all data read
+#define SERVO_MOTION_DATA       0x56 // servo motion profiles: reply when a servo has reached its target
+#define WAVEFORM_DATA           0x57 // play sample tables on PWM pins
+#define ANALOG_FADE_DATA        0x58 // fade PWM pins to a target duty on the device
+#define DIGITAL_PATTERN_DATA    0x59 // play a table of timed digital port writes
+#define DIGITAL_PORTS_WRITE     0x5A // write several digital ports at once
+#define CAPTURE_DATA            0x5B // triggered capture of analog and digital channels into a buffer
+#define DIGITAL_DEBOUNCE        0x5C // set the debounce time of a digital input pin
+#define DIGITAL_EVENT_DATA      0x5D // capture pin changes with interrupts, reply with the timestamped changes
+#define REPORT_TIMESTAMP        0x5E // device time in microseconds (packed 32 bit) of the report messages that follow
+#define ANALOG_STREAM_DATA      0x5F // start/stop fixed rate analog sampling, reply with blocks of samples
 #define SERIAL_MESSAGE          0x60 // communicate with serial devices, including other boards
 #define ENCODER_DATA            0x61 // reply with encoders current positions
 #define ACCELSTEPPER_DATA       0x62 // control a stepper motor
@@ -71,6 +82,7 @@
 #define EXTENDED_REPORT_ANALOG  0x64 // Enable reporting analog channels > 15. Supported with v3.1 or later.
 #define REPORT_FEATURES         0x65 // (reserved)
 #define SYSTEM_VARIABLE         0x66 // System Variable Set/Query (in testing, from protocol version 2.7)
+#define ANALOG_FRAME            0x67 // timestamp and values of several analog channels sampled together
 #define SPI_DATA                0x68 // SPI Commands start with this byte
 #define ANALOG_MAPPING_QUERY    0x69 // ask for mapping of analog to pin numbers
 #define ANALOG_MAPPING_RESPONSE 0x6A // reply with mapping info
@@ -179,7 +191,7 @@ class FirmataClass
     boolean isParsingMessage(void);
     boolean isResetting(void);
     /* serial send handling */
-    void sendAnalog(byte pin, int value);
+    void sendAnalog(byte pin, uint32_t value);
     void sendDigital(byte pin, int value); // TODO implement this
     void sendDigitalPort(byte portNumber, int portData);
     void sendString(const FlashString* flashString);
@@ -187,6 +199,9 @@ class FirmataClass
     void sendStringf(const FlashString* fmt, ...);
     void sendString(byte command, const char *string);
     void sendSysex(byte command, byte bytec, byte *bytev);
+    void sendTimestampIfDue();
+    void setTimestampResolution(uint32_t microseconds);
+    uint32_t getTimestampResolution();
     void write(byte c);
 
     size_t write(byte* buf, size_t length);
@@ -255,6 +270,11 @@ class FirmataClass
 
     boolean blinkVersionDisabled;
 
+    /* report timestamps */
+    uint32_t timestampResolution; // 0 = no timestamps
+    uint32_t lastTimestamp;
+    boolean timestampSent;
+
     /* private methods ------------------------------ */
     void processSysexMessage(void);
     void systemReset(void);
@@ -0,0 +1,215 @@
+/*
+  DigitalEventFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "DigitalEventFirmata.h"
+
+#ifndef ARDUINO_ISR_ATTR
+#define ARDUINO_ISR_ATTR
+#endif
+
+static_assert(DIGITAL_EVENT_MAX_PINS <= 8, "Only 8 interrupt handlers available");
+
+DigitalEventFirmata *DigitalEventFirmataInstance;
+
+// attachInterrupt() doesn't pass an argument on all boards, so there's one handler per slot
+template<byte SLOT>
+static void ARDUINO_ISR_ATTR DigitalEventIsr()
+{
+  DigitalEventFirmataInstance->handleInterrupt(SLOT);
+}
+
+static void (*const DigitalEventIsrs[8])() =
+{
+  DigitalEventIsr<0>, DigitalEventIsr<1>, DigitalEventIsr<2>, DigitalEventIsr<3>,
+  DigitalEventIsr<4>, DigitalEventIsr<5>, DigitalEventIsr<6>, DigitalEventIsr<7>
+};
+
+DigitalEventFirmata::DigitalEventFirmata()
+{
+  DigitalEventFirmataInstance = this;
+  for (byte i = 0; i < DIGITAL_EVENT_MAX_PINS; i++)
+  {
+    slotPins[i] = DIGITAL_EVENT_NO_PIN;
+  }
+  overflow = false;
+  lostEvents = 0;
+}
+
+void DigitalEventFirmata::handleInterrupt(byte slot)
+{
+  // Only the interrupt handlers push to the queue and only the main loop pops, so no lock is needed
+  uint32_t now = micros();
+  byte pin = slotPins[slot];
+  if (overflow)
+  {
+    lostEvents++;
+    return;
+  }
+  digital_event event;
+  event.time = now;
+  event.pin = pin;
+  event.level = digitalRead(PIN_TO_DIGITAL(pin)) == HIGH ? 1 : 0;
+  if (!events.push(event))
+  {
+    overflow = true;
+    lostEvents++;
+  }
+}
+
+boolean DigitalEventFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != DIGITAL_EVENT_DATA || argc < 1)
+  {
+    return false;
+  }
+  if (argv[0] == DIGITAL_EVENT_ENABLE && argc >= 3)
+  {
+    if (argv[2])
+    {
+      enableCapture(argv[1]);
+    }
+    else
+    {
+      disableCapture(argv[1]);
+    }
+    return true;
+  }
+  return false;
+}
+
+void DigitalEventFirmata::enableCapture(byte pin)
+{
+  if (pin >= TOTAL_PINS || !IS_PIN_DIGITAL(pin) ||
+      (Firmata.getPinMode(pin) != PIN_MODE_INPUT && Firmata.getPinMode(pin) != PIN_MODE_PULLUP))
+  {
+    Firmata.sendString(F("Digital events require a pin in input mode"));
+    return;
+  }
+  int interrupt = digitalPinToInterrupt(PIN_TO_DIGITAL(pin));
+  if (interrupt < 0)
+  {
+    Firmata.sendString(F("Pin has no interrupt for digital events"));
+    return;
+  }
+  byte freeSlot = DIGITAL_EVENT_NO_PIN;
+  for (byte i = 0; i < DIGITAL_EVENT_MAX_PINS; i++)
+  {
+    if (slotPins[i] == pin)
+    {
+      return;
+    }
+    if (slotPins[i] == DIGITAL_EVENT_NO_PIN && freeSlot == DIGITAL_EVENT_NO_PIN)
+    {
+      freeSlot = i;
+    }
+  }
+  if (freeSlot == DIGITAL_EVENT_NO_PIN)
+  {
+    Firmata.sendString(F("Too many pins with digital events"));
+    return;
+  }
+  slotPins[freeSlot] = pin;
+  attachInterrupt(interrupt, DigitalEventIsrs[freeSlot], CHANGE);
+}
+
+void DigitalEventFirmata::disableCapture(byte pin)
+{
+  for (byte i = 0; i < DIGITAL_EVENT_MAX_PINS; i++)
+  {
+    if (slotPins[i] == pin)
+    {
+      detachInterrupt(digitalPinToInterrupt(PIN_TO_DIGITAL(pin)));
+      slotPins[i] = DIGITAL_EVENT_NO_PIN;
+    }
+  }
+}
+
+void DigitalEventFirmata::sendEvents()
+{
+  digital_event event;
+  while (events.pop(event))
+  {
+    Firmata.startSysex();
+    Firmata.write(DIGITAL_EVENT_DATA);
+    Firmata.write(DIGITAL_EVENT_REPORT);
+    Firmata.sendPackedUInt32(event.time);
+    uint32_t previousTime = event.time;
+    byte count = 0;
+    do
+    {
+      uint32_t delta = event.time - previousTime;
+      if (delta > 0x0FFFFFFF)
+      {
+        delta = 0x0FFFFFFF;
+      }
+      Firmata.write(event.pin);
+      Firmata.write(event.level);
+      Firmata.write((byte)(delta & 0x7F));
+      Firmata.write((byte)((delta >> 7) & 0x7F));
+      Firmata.write((byte)((delta >> 14) & 0x7F));
+      Firmata.write((byte)((delta >> 21) & 0x7F));
+      previousTime = event.time;
+      count++;
+    } while (count < DIGITAL_EVENT_MAX_BATCH && events.pop(event));
+    Firmata.endSysex();
+  }
+}
+
+void DigitalEventFirmata::report(bool elapsed)
+{
+  // Once the overflow flag is set, the interrupt doesn't queue events anymore,
+  // so the queue is complete after sending it.
+  bool wasOverflow = overflow;
+  sendEvents();
+  if (!wasOverflow)
+  {
+    return;
+  }
+  noInterrupts();
+  uint32_t lost = lostEvents;
+  lostEvents = 0;
+  overflow = false;
+  interrupts();
+  Firmata.startSysex();
+  Firmata.write(DIGITAL_EVENT_DATA);
+  Firmata.write(DIGITAL_EVENT_OVERFLOW);
+  Firmata.sendPackedUInt32(lost);
+  Firmata.endSysex();
+}
+
+boolean DigitalEventFirmata::handlePinMode(byte pin, int mode)
+{
+  // Stop capturing when the pin is used for something else
+  if (mode != PIN_MODE_INPUT && mode != PIN_MODE_PULLUP)
+  {
+    disableCapture(pin);
+  }
+  return false;
+}
+
+void DigitalEventFirmata::handleCapability(byte pin)
+{
+}
+
+void DigitalEventFirmata::reset()
+{
+  for (byte i = 0; i < DIGITAL_EVENT_MAX_PINS; i++)
+  {
+    if (slotPins[i] != DIGITAL_EVENT_NO_PIN)
+    {
+      disableCapture(slotPins[i]);
+    }
+  }
+  events.clear();
+  overflow = false;
+  lostEvents = 0;
+}
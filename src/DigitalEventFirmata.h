@@ -0,0 +1,79 @@
+/*
+  DigitalEventFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef DigitalEventFirmata_h
+#define DigitalEventFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "utility/SampleRingBuffer.h"
+
+// Subcommands of DIGITAL_EVENT_DATA
+#define DIGITAL_EVENT_ENABLE    0x00 // pin, 1 to capture the changes of the pin, 0 to stop
+#define DIGITAL_EVENT_REPORT    0x01 // reply: timestamp of the first event in microseconds (packed 32 bit), then for each event
+                                     // the pin, the new level and the time since the previous event (packed 28 bit, 4 bytes)
+#define DIGITAL_EVENT_OVERFLOW  0x02 // reply: number of events lost after the last reported event (packed 32 bit)
+
+// At most 8 pins can be captured at the same time. The queue size must be a power of 2.
+#ifndef DIGITAL_EVENT_MAX_PINS
+#ifdef LARGE_MEM_DEVICE
+#define DIGITAL_EVENT_MAX_PINS    8
+#else
+#define DIGITAL_EVENT_MAX_PINS    2
+#endif
+#endif
+#ifndef DIGITAL_EVENT_QUEUE_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define DIGITAL_EVENT_QUEUE_SIZE  128
+#else
+#define DIGITAL_EVENT_QUEUE_SIZE  16
+#endif
+#endif
+#define DIGITAL_EVENT_MAX_BATCH   8 // events per DIGITAL_EVENT_REPORT message
+#define DIGITAL_EVENT_NO_PIN      0xFF
+
+struct digital_event {
+  uint32_t time; // micros()
+  byte pin;
+  byte level;
+};
+
+/*
+ * Captures the changes of digital input pins with pin change interrupts, so that pulses
+ * shorter than a loop iteration are not lost. The events are queued in the interrupt handler
+ * and sent in batches from report(). When the queue is full, no events are queued until the
+ * main loop has sent the queue and reported the number of lost events with DIGITAL_EVENT_OVERFLOW.
+ * The pins must be set to PIN_MODE_INPUT or PIN_MODE_PULLUP first.
+ */
+class DigitalEventFirmata: public FirmataFeature
+{
+  public:
+    DigitalEventFirmata();
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    void reset() override;
+    void report(bool elapsed) override;
+
+    void handleInterrupt(byte slot);
+
+  private:
+    void enableCapture(byte pin);
+    void disableCapture(byte pin);
+    void sendEvents();
+
+    byte slotPins[DIGITAL_EVENT_MAX_PINS]; // pin captured in each slot, DIGITAL_EVENT_NO_PIN if free
+    SampleRingBuffer<digital_event, DIGITAL_EVENT_QUEUE_SIZE> events;
+    volatile bool overflow;
+    volatile uint32_t lostEvents;
+};
+
+#endif
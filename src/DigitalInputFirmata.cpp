@@ -33,6 +33,14 @@ DigitalInputFirmata::DigitalInputFirmata()
     portConfigInputs[i] = 0;
     previousPINs[i] = 0;
     reportPINs[i] = 0;
+    debounceMask[i] = 0;
+    rawPINs[i] = 0;
+    debouncedPINs[i] = 0;
+  }
+  for (int i = 0; i < TOTAL_PINS; i++)
+  {
+    debounceTime[i] = 0;
+    lastChange[i] = 0;
   }
   DigitalInputFirmataInstance = this;
   Firmata.attach(REPORT_DIGITAL, reportDigitalInputCallback);
@@ -40,13 +48,101 @@ DigitalInputFirmata::DigitalInputFirmata()
 
 boolean DigitalInputFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
+  if (command == SAMPLING_INTERVAL && argc >= 4 && argv[2] == SAMPLING_INTERVAL_DIGITAL_PORT)
+  {
+    byte port = argv[3];
+    if (port < TOTAL_PORTS)
+    {
+      portTimers[port].setInterval(Firmata.decodePackedUInt14(argv));
+    }
+    return true;
+  }
+  if (command == SAMPLING_INTERVAL_QUERY && argc >= 2 && argv[0] == SAMPLING_INTERVAL_DIGITAL_PORT)
+  {
+    byte port = argv[1];
+    if (port < TOTAL_PORTS)
+    {
+      FirmataReporting::sendSamplingInterval(portTimers[port].getInterval(), SAMPLING_INTERVAL_DIGITAL_PORT, port);
+    }
+    return true;
+  }
+  if (command == DIGITAL_DEBOUNCE && argc >= 2)
+  {
+    byte pin = argv[0];
+    if (pin < TOTAL_PINS && IS_PIN_DIGITAL(pin))
+    {
+      setDebounceTime(pin, argv[1]);
+    }
+    return true;
+  }
   return false;
 }
 
+void DigitalInputFirmata::setDebounceTime(byte pin, byte time)
+{
+  byte port = pin / 8;
+  byte bit = 1 << (pin & 7);
+  if (time > DIGITAL_DEBOUNCE_MAX_TIME)
+  {
+    time = DIGITAL_DEBOUNCE_MAX_TIME;
+  }
+  debounceTime[pin] = time;
+  if (time == 0)
+  {
+    debounceMask[port] &= ~bit;
+    return;
+  }
+  if (!(debounceMask[port] & bit))
+  {
+    // Start with the current level as the stable level
+    byte value = readPort(port, bit);
+    rawPINs[port] = (rawPINs[port] & ~bit) | (value & bit);
+    debouncedPINs[port] = (debouncedPINs[port] & ~bit) | (value & bit);
+    lastChange[pin] = (byte)millis();
+    debounceMask[port] |= bit;
+  }
+}
+
+/*
+ * Replaces the levels of the debounced pins of a port with their stable levels. A pin gets
+ * a new stable level when its raw level has not changed for the debounce time of the pin.
+ */
+byte DigitalInputFirmata::debounce(byte portNumber, byte portValue)
+{
+  byte mask = debounceMask[portNumber];
+  byte now = (byte)millis();
+  byte changed = (portValue ^ rawPINs[portNumber]) & mask;
+  byte stable = debouncedPINs[portNumber];
+  rawPINs[portNumber] = portValue;
+  byte pending = (portValue ^ stable) & mask & ~changed;
+  for (byte i = 0; i < 8 && (changed | pending); i++)
+  {
+    byte bit = 1 << i;
+    byte pin = portNumber * 8 + i;
+    if (changed & bit)
+    {
+      // Still bouncing, restart the time
+      lastChange[pin] = now;
+    }
+    else if ((pending & bit) && (byte)(now - lastChange[pin]) >= debounceTime[pin])
+    {
+      stable ^= bit;
+    }
+    changed &= ~bit;
+    pending &= ~bit;
+  }
+  debouncedPINs[portNumber] = stable;
+  return (portValue & ~mask) | (stable & mask);
+}
+
 void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte forceSend)
 {
   // pins not configured as INPUT are cleared to zeros
   portValue = portValue & portConfigInputs[portNumber];
+  if (debounceMask[portNumber])
+  {
+    portValue = debounce(portNumber, portValue);
+  }
   // only send if the value is different than previously sent
   if (forceSend || previousPINs[portNumber] != portValue) {
     Firmata.sendDigitalPort(portNumber, portValue);
@@ -54,41 +150,35 @@ void DigitalInputFirmata::outputPort(byte portNumber, byte portValue, byte force
   }
 }
 
+template<byte PORT>
+inline void DigitalInputFirmata::reportPort(uint32_t now)
+{
+  if (reportPINs[PORT] && portTimers[PORT].isDue(true, now)) {
+    outputPort(PORT, readPort(PORT, portConfigInputs[PORT]), false);
+  }
+}
+
+/* Reports the ports 0 to N - 1. The recursion is resolved at compile time, so every
+ * call to readPort() gets a constant port number, which allows the compiler to
+ * reduce it to a few instructions. */
+inline void DigitalInputFirmata::reportPorts(FirmataPortCount<0>, uint32_t now)
+{
+}
+
+template<byte N>
+inline void DigitalInputFirmata::reportPorts(FirmataPortCount<N>, uint32_t now)
+{
+  reportPorts(FirmataPortCount<N - 1>(), now);
+  reportPort<N - 1>(now);
+}
+
 /* -----------------------------------------------------------------------------
  * check all the active digital inputs for change of state, then add any events
  * to the Serial output queue using Serial.print() */
 void DigitalInputFirmata::report(bool elapsed)
 {
-#ifdef ARDUINO_PINOUT_OPTIMIZE /* AVR type boards */
-  /* Using non-looping code allows constants to be given to readPort().
-   * The compiler will apply substantial optimizations if the inputs
-   * to readPort() are compile-time constants. */
-  if (TOTAL_PORTS > 0 && reportPINs[0]) outputPort(0, readPort(0, portConfigInputs[0]), false);
-  if (TOTAL_PORTS > 1 && reportPINs[1]) outputPort(1, readPort(1, portConfigInputs[1]), false);
-  if (TOTAL_PORTS > 2 && reportPINs[2]) outputPort(2, readPort(2, portConfigInputs[2]), false);
-  if (TOTAL_PORTS > 3 && reportPINs[3]) outputPort(3, readPort(3, portConfigInputs[3]), false);
-  if (TOTAL_PORTS > 4 && reportPINs[4]) outputPort(4, readPort(4, portConfigInputs[4]), false);
-  if (TOTAL_PORTS > 5 && reportPINs[5]) outputPort(5, readPort(5, portConfigInputs[5]), false);
-  if (TOTAL_PORTS > 6 && reportPINs[6]) outputPort(6, readPort(6, portConfigInputs[6]), false);
-  if (TOTAL_PORTS > 7 && reportPINs[7]) outputPort(7, readPort(7, portConfigInputs[7]), false);
-  if (TOTAL_PORTS > 8 && reportPINs[8]) outputPort(8, readPort(8, portConfigInputs[8]), false);
-  if (TOTAL_PORTS > 9 && reportPINs[9]) outputPort(9, readPort(9, portConfigInputs[9]), false);
-  if (TOTAL_PORTS > 10 && reportPINs[10]) outputPort(10, readPort(10, portConfigInputs[10]), false);
-  if (TOTAL_PORTS > 11 && reportPINs[11]) outputPort(11, readPort(11, portConfigInputs[11]), false);
-  if (TOTAL_PORTS > 12 && reportPINs[12]) outputPort(12, readPort(12, portConfigInputs[12]), false);
-  if (TOTAL_PORTS > 13 && reportPINs[13]) outputPort(13, readPort(13, portConfigInputs[13]), false);
-  if (TOTAL_PORTS > 14 && reportPINs[14]) outputPort(14, readPort(14, portConfigInputs[14]), false);
-  if (TOTAL_PORTS > 15 && reportPINs[15]) outputPort(15, readPort(15, portConfigInputs[15]), false);
-#else
-    for (byte i = 0; i < TOTAL_PORTS; i++)
-    {
-        // Less compiler warnings. Performance shouldn't be an issue with the 32 bit boards here
-	    if (reportPINs[i])
-	    {
-            outputPort(i, readPort(i, portConfigInputs[i]), false);
-	    }
-    }
-#endif
+  // Digital ports are polled on every call, unless they have their own sampling interval
+  reportPorts(FirmataPortCount<TOTAL_PORTS>(), millis());
 }
 
 void DigitalInputFirmata::reportDigital(byte port, int value)
@@ -144,5 +234,10 @@ void DigitalInputFirmata::reset()
     reportPINs[i] = false;      // by default, reporting off
     portConfigInputs[i] = 0;    // until activated
     previousPINs[i] = 0;
+    portTimers[i].setInterval(0);
+    debounceMask[i] = 0;
+  }
+  for (byte i = 0; i < TOTAL_PINS; i++) {
+    debounceTime[i] = 0;
   }
 }
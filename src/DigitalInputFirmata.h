@@ -19,9 +19,16 @@
 
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
+#include "FirmataReporting.h"
+
+// A DIGITAL_DEBOUNCE message contains the pin and the time in ms (0 - DIGITAL_DEBOUNCE_MAX_TIME, 0 = off)
+// a new level must be stable before it is reported. The debounce time should be larger than the sampling interval of the port.
+#define DIGITAL_DEBOUNCE_MAX_TIME 127
 
 void reportDigitalInputCallback(byte port, int value);
 
+template<byte N> struct FirmataPortCount {};
+
 class DigitalInputFirmata: public FirmataFeature
 {
   public:
@@ -37,10 +44,23 @@ class DigitalInputFirmata: public FirmataFeature
     /* digital input ports */
     byte reportPINs[TOTAL_PORTS];       // 1 = report this port, 0 = silence
     byte previousPINs[TOTAL_PORTS];     // previous 8 bits sent
+    ReportTimer portTimers[TOTAL_PORTS]; // interval 0 = poll on every loop
+
+    /* debouncing */
+    byte debounceMask[TOTAL_PORTS];     // each bit: 1 = pin is debounced
+    byte rawPINs[TOTAL_PORTS];          // last levels read, before debouncing
+    byte debouncedPINs[TOTAL_PORTS];    // last stable levels
+    byte debounceTime[TOTAL_PINS];      // in ms
+    byte lastChange[TOTAL_PINS];        // lower 8 bits of millis() when the raw level last changed
+    void setDebounceTime(byte pin, byte time);
+    byte debounce(byte portNumber, byte portValue);
 
     /* pins configuration */
     byte portConfigInputs[TOTAL_PORTS]; // each bit: 1 = pin in INPUT, 0 = anything else
     void outputPort(byte portNumber, byte portValue, byte forceSend);
+    template<byte PORT> void reportPort(uint32_t now);
+    void reportPorts(FirmataPortCount<0>, uint32_t now);
+    template<byte N> void reportPorts(FirmataPortCount<N>, uint32_t now);
 };
 
 #endif
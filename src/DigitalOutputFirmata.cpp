@@ -45,12 +45,25 @@ void handleSetPinValueCallback(byte pin, int value)
 DigitalOutputFirmata::DigitalOutputFirmata()
 {
   DigitalOutputFirmataInstance = this;
+  for (byte port = 0; port < TOTAL_PORTS; port++) {
+    outputMask[port] = 0;
+    inputMask[port] = 0;
+    pullupMask[port] = 0;
+  }
+  // Pins start in PIN_MODE_INPUT without a call to handlePinMode()
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    updateMasks(pin, Firmata.getPinMode(pin));
+  }
   Firmata.attach(DIGITAL_MESSAGE, digitalOutputWriteCallback);
   Firmata.attach(SET_DIGITAL_PIN_VALUE, handleSetPinValueCallback);
 }
 
 boolean DigitalOutputFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
+  if (command == DIGITAL_PORTS_WRITE) {
+    writePorts(argc, argv);
+    return true;
+  }
   return false;
 }
 
@@ -59,36 +72,95 @@ void DigitalOutputFirmata::reset()
 
 }
 
-void DigitalOutputFirmata::digitalWritePort(byte port, int value)
+/*
+ * Updates the cached masks of the port of the pin. Called for every pin mode change.
+ */
+void DigitalOutputFirmata::updateMasks(byte pin, int mode)
 {
-  byte pin, lastPin, pinValue, mask = 1, pinWriteMask = 0;
+  if (!IS_PIN_DIGITAL(pin)) {
+    return;
+  }
+  byte port = pin / 8;
+  byte bit = 1 << (pin & 7);
+  outputMask[port] &= ~bit;
+  inputMask[port] &= ~bit;
+  pullupMask[port] &= ~bit; // the pin state is reset with every mode change
+  if (mode == PIN_MODE_OUTPUT) {
+    outputMask[port] |= bit;
+  } else if (mode == PIN_MODE_INPUT) {
+    inputMask[port] |= bit;
+  }
+}
 
-  if (port < TOTAL_PORTS) {
-    // create a mask of the pins on this port that are writable.
-    lastPin = port * 8 + 8;
-    if (lastPin > TOTAL_PINS) lastPin = TOTAL_PINS;
-    for (pin = port * 8; pin < lastPin; pin++) {
-      // do not disturb non-digital pins (eg, Rx & Tx)
-      if (IS_PIN_DIGITAL(pin)) {
-        // do not touch pins in PWM, ANALOG, SERVO or other modes
-        if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT || Firmata.getPinMode(pin) == INPUT) {
-          pinValue = ((byte)value & mask) ? 1 : 0;
-          if (Firmata.getPinMode(pin) == PIN_MODE_OUTPUT) {
-            pinWriteMask |= mask;
-          } else if (Firmata.getPinMode(pin) == INPUT && pinValue == 1 && Firmata.getPinState(pin) != 1) {
-            pinMode(pin, INPUT_PULLUP);
-          }
-          Firmata.setPinState(pin, pinValue);
-        }
+/*
+ * Updates the pin states of the pins in mask and enables the pull-ups of input pins that are set to 1.
+ * Returns the pins that need to be written.
+ */
+byte DigitalOutputFirmata::preparePortWrite(byte port, byte value, byte mask)
+{
+  // do not touch pins in PWM, ANALOG, SERVO or other modes
+  byte outputs = outputMask[port] & mask;
+  byte inputs = inputMask[port] & mask;
+  byte newPullups = value & inputs & ~pullupMask[port];
+  if (newPullups) {
+    for (byte i = 0; i < 8; i++) {
+      if (newPullups & (1 << i)) {
+        pinMode(PIN_TO_DIGITAL(port * 8 + i), INPUT_PULLUP);
       }
-      mask = mask << 1;
     }
-    writePort(port, (byte)value, pinWriteMask);
   }
+  pullupMask[port] = (pullupMask[port] & ~inputs) | (value & inputs);
+
+  byte changed = outputs | inputs;
+  for (byte i = 0; changed; i++, changed >>= 1) {
+    if (changed & 1) {
+      Firmata.setPinState(port * 8 + i, (value >> i) & 1);
+    }
+  }
+  return outputs;
+}
+
+void DigitalOutputFirmata::digitalWritePort(byte port, int value)
+{
+  if (port < TOTAL_PORTS) {
+    writePort(port, (byte)value, preparePortWrite(port, (byte)value, 0xFF));
+  }
+}
+
+void DigitalOutputFirmata::writePorts(byte argc, byte* argv)
+{
+  byte values[TOTAL_PORTS];
+  byte writeMasks[TOTAL_PORTS];
+  for (byte port = 0; port < TOTAL_PORTS; port++) {
+    values[port] = 0;
+    writeMasks[port] = 0;
+  }
+
+  // Parse everything first, so that the critical section only contains the register writes
+  for (byte i = 0; i + 5 <= argc; i += 5) {
+    byte port = argv[i];
+    if (port >= TOTAL_PORTS) {
+      continue;
+    }
+    byte value = (byte)(argv[i + 1] | (argv[i + 2] << 7));
+    byte mask = (byte)(argv[i + 3] | (argv[i + 4] << 7));
+    byte writeMask = preparePortWrite(port, value, mask);
+    values[port] = (values[port] & ~writeMask) | (value & writeMask);
+    writeMasks[port] |= writeMask;
+  }
+
+  noInterrupts();
+  for (byte port = 0; port < TOTAL_PORTS; port++) {
+    if (writeMasks[port]) {
+      writePortRaw(port, values[port], writeMasks[port]);
+    }
+  }
+  interrupts();
 }
 
 boolean DigitalOutputFirmata::handlePinMode(byte pin, int mode)
 {
+  updateMasks(pin, mode);
   if (IS_PIN_DIGITAL(pin) && mode == PIN_MODE_OUTPUT && Firmata.getPinMode(pin) != PIN_MODE_IGNORE) {
     digitalWrite(PIN_TO_DIGITAL(pin), LOW); // disable PWM
     pinMode(PIN_TO_DIGITAL(pin), OUTPUT);
@@ -22,6 +22,9 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 
+// A DIGITAL_PORTS_WRITE message contains one or more groups of: port, value (2 bytes), mask (2 bytes).
+// Only the pins in the mask are changed. All ports are written inside one critical section.
+
 void digitalOutputWriteCallback(byte port, int value);
 void handleSetPinValueCallback(byte pin, int value);
 
@@ -35,6 +38,14 @@ class DigitalOutputFirmata: public FirmataFeature
     boolean handlePinMode(byte pin, int mode);
     void reset();
   private:
+    void updateMasks(byte pin, int mode);
+    byte preparePortWrite(byte port, byte value, byte mask);
+    void writePorts(byte argc, byte* argv);
+
+    /* cached from the pin modes, each bit is one pin */
+    byte outputMask[TOTAL_PORTS]; // pins in PIN_MODE_OUTPUT
+    byte inputMask[TOTAL_PORTS];  // pins in PIN_MODE_INPUT, writing 1 enables the pull-up
+    byte pullupMask[TOTAL_PORTS]; // input pins whose pin state is 1
 };
 
 #endif
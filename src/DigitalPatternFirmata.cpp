@@ -0,0 +1,283 @@
+/*
+  DigitalPatternFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "DigitalPatternFirmata.h"
+
+DigitalPatternFirmata *DigitalPatternFirmataInstance;
+
+#ifdef ESP32
+static void ARDUINO_ISR_ATTR DigitalPatternIsr()
+{
+  DigitalPatternFirmataInstance->handleTimer();
+}
+#endif
+
+DigitalPatternFirmata::DigitalPatternFirmata()
+{
+  DigitalPatternFirmataInstance = this;
+  numSteps = 0;
+  currentStep = 0;
+  remainingRuns = 0;
+  running = false;
+  done = false;
+#ifdef ESP32
+  timer = nullptr;
+  alarmTime = 0;
+#else
+  nextStepTime = 0;
+  stepDelay = 0;
+  reportedLate = false;
+#endif
+}
+
+void DigitalPatternFirmata::handleCapability(byte pin)
+{
+}
+
+boolean DigitalPatternFirmata::handlePinMode(byte pin, int mode)
+{
+  return false;
+}
+
+boolean DigitalPatternFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != DIGITAL_PATTERN_DATA || argc < 1)
+  {
+    return false;
+  }
+  switch (argv[0])
+  {
+    case PATTERN_CLEAR:
+      stop();
+      numSteps = 0;
+      return true;
+    case PATTERN_APPEND:
+      if (running)
+      {
+        Firmata.sendString(F("Cannot change the pattern while playing"));
+        return true;
+      }
+      appendSteps(argc - 1, argv + 1);
+      return true;
+    case PATTERN_START:
+      start(argc >= 3 ? Firmata.decodePackedUInt14(argv + 1) : 1);
+      return true;
+    case PATTERN_STOP:
+      stop();
+      return true;
+  }
+  return false;
+}
+
+void DigitalPatternFirmata::appendSteps(byte argc, byte* argv)
+{
+  for (byte i = 0; i + 10 <= argc; i += 10)
+  {
+    if (numSteps >= PATTERN_MAX_STEPS)
+    {
+      Firmata.sendString(F("Too many pattern steps"));
+      return;
+    }
+    byte port = argv[i];
+    if (port >= TOTAL_PORTS)
+    {
+      continue;
+    }
+    pattern_step& step = steps[numSteps];
+    step.port = port;
+    step.value = (byte)(argv[i + 1] | (argv[i + 2] << 7));
+    step.mask = (byte)(argv[i + 3] | (argv[i + 4] << 7));
+    step.delay = Firmata.decodePackedUInt32(argv + i + 5);
+    numSteps++;
+  }
+}
+
+/*
+ * Returns the pins of the port that are in output mode. Checked at every step, as the pin modes may change
+ * during playback.
+ */
+byte DigitalPatternFirmata::outputPins(byte port)
+{
+  byte mask = 0;
+  for (byte bit = 0; bit < 8; bit++)
+  {
+    byte pin = port * 8 + bit;
+    if (pin < TOTAL_PINS && IS_PIN_DIGITAL(pin) && Firmata.getPinMode(pin) == PIN_MODE_OUTPUT)
+    {
+      mask |= 1 << bit;
+    }
+  }
+  return mask;
+}
+
+/*
+ * Writes the current step and all following steps with a delay of 0, or only moves past them if write
+ * is false. Returns the delay until the next step. Must be called with interrupts disabled.
+ */
+uint32_t DigitalPatternFirmata::playSteps(bool write)
+{
+  while (true)
+  {
+    const pattern_step& step = steps[currentStep];
+    if (write)
+    {
+      // Like DIGITAL_MESSAGE, only touch pins in output mode
+      writePortRaw(step.port, step.value, step.mask & outputPins(step.port));
+    }
+    currentStep = currentStep + 1;
+    if (currentStep == numSteps)
+    {
+      currentStep = 0;
+      if (remainingRuns > 0 && --remainingRuns == 0)
+      {
+        running = false;
+        done = true;
+        return 0;
+      }
+    }
+    if (step.delay > 0)
+    {
+      return step.delay;
+    }
+  }
+}
+
+#ifndef ESP32
+/*
+ * Returns the delay after the steps that playSteps() would play next.
+ */
+uint32_t DigitalPatternFirmata::nextDelay()
+{
+  uint16_t i = currentStep;
+  while (steps[i].delay == 0)
+  {
+    i = (i + 1) % numSteps;
+  }
+  return steps[i].delay;
+}
+#endif
+
+void DigitalPatternFirmata::start(uint16_t runs)
+{
+  stop();
+  uint32_t totalDelay = 0;
+  for (uint16_t i = 0; i < numSteps; i++)
+  {
+    totalDelay += steps[i].delay;
+  }
+  if (numSteps == 0 || totalDelay == 0)
+  {
+    Firmata.sendString(F("Pattern needs at least one step with a delay"));
+    return;
+  }
+  currentStep = 0;
+  remainingRuns = runs;
+  done = false;
+  running = true;
+  noInterrupts();
+  uint32_t delay = playSteps();
+  interrupts();
+  if (!running)
+  {
+    return;
+  }
+#ifdef ESP32
+  timer = timerBegin(1000000);
+  timerAttachInterrupt(timer, DigitalPatternIsr);
+  alarmTime = delay;
+  timerAlarm(timer, alarmTime, false, 0);
+#else
+  stepDelay = delay;
+  nextStepTime = micros();
+  reportedLate = false;
+#endif
+}
+
+void DigitalPatternFirmata::handleTimer()
+{
+#ifdef ESP32
+  if (!running)
+  {
+    return;
+  }
+  uint32_t delay = playSteps();
+  if (running)
+  {
+    // The counter keeps running, so the latency of the interrupt doesn't add up over the steps
+    alarmTime += delay;
+    timerAlarm(timer, alarmTime, false, 0);
+  }
+#endif
+}
+
+void DigitalPatternFirmata::stop()
+{
+  bool wasRunning = running;
+  running = false;
+#ifdef ESP32
+  if (timer != nullptr)
+  {
+    timerEnd(timer);
+    timer = nullptr;
+  }
+#endif
+  if (wasRunning)
+  {
+    done = true;
+  }
+}
+
+void DigitalPatternFirmata::report(bool elapsed)
+{
+#ifndef ESP32
+  // Play from the loop, keeping the steps on their schedule. If the loop was late, the steps that were missed
+  // are skipped, so that only the steps due now are written instead of a burst of all of them.
+  bool skipped = false;
+  while (running && micros() - nextStepTime >= stepDelay)
+  {
+    nextStepTime += stepDelay;
+    bool missed = micros() - nextStepTime >= nextDelay();
+    skipped |= missed;
+    noInterrupts();
+    stepDelay = playSteps(!missed);
+    interrupts();
+  }
+  if (skipped && !reportedLate)
+  {
+    // Once per playback, a pattern faster than the loop would send this on every pass
+    reportedLate = true;
+    Firmata.sendString(F("Pattern playback was late, steps skipped"));
+  }
+#endif
+  if (done)
+  {
+    done = false;
+#ifdef ESP32
+    if (timer != nullptr)
+    {
+      timerEnd(timer);
+      timer = nullptr;
+    }
+#endif
+    Firmata.startSysex();
+    Firmata.write(DIGITAL_PATTERN_DATA);
+    Firmata.write(PATTERN_DONE);
+    Firmata.endSysex();
+  }
+}
+
+void DigitalPatternFirmata::reset()
+{
+  stop();
+  done = false;
+  numSteps = 0;
+}
@@ -0,0 +1,84 @@
+/*
+  DigitalPatternFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef DigitalPatternFirmata_h
+#define DigitalPatternFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+
+// Subcommands of DIGITAL_PATTERN_DATA
+#define PATTERN_CLEAR   0x00 // remove all steps
+#define PATTERN_APPEND  0x01 // one or more steps of: port, value (2 bytes), mask (2 bytes), delay in microseconds until
+                             // the next step (packed 32 bit). Steps with delay 0 are written together with the next step.
+#define PATTERN_START   0x02 // number of runs through the steps (2 bytes), 0 to repeat until PATTERN_STOP
+#define PATTERN_STOP    0x03
+#define PATTERN_DONE    0x04 // reply when the last run has finished or the playback was stopped
+
+#ifndef PATTERN_MAX_STEPS
+#ifdef LARGE_MEM_DEVICE
+#define PATTERN_MAX_STEPS 256
+#else
+#define PATTERN_MAX_STEPS 16
+#endif
+#endif
+
+struct pattern_step {
+  uint32_t delay; // in microseconds
+  byte port;
+  byte value;
+  byte mask;      // pins of the port to write, those not in PIN_MODE_OUTPUT are skipped
+};
+
+/*
+ * Plays a table of digital port writes with exact delays. On the ESP32 the steps are written from
+ * a hardware timer interrupt. Other boards play the steps from the main loop on the schedule given
+ * by micros(), which adds the loop latency as jitter. Steps that the loop has missed entirely are skipped.
+ * The pin states seen by PIN_STATE_QUERY are not updated during playback.
+ */
+class DigitalPatternFirmata: public FirmataFeature
+{
+  public:
+    DigitalPatternFirmata();
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    void reset() override;
+    void report(bool elapsed) override;
+
+    void handleTimer();
+
+  private:
+    void appendSteps(byte argc, byte* argv);
+    void start(uint16_t runs);
+    void stop();
+    uint32_t playSteps(bool write = true);
+    byte outputPins(byte port);
+
+    pattern_step steps[PATTERN_MAX_STEPS];
+    uint16_t numSteps;
+    volatile uint16_t currentStep;
+    volatile uint16_t remainingRuns; // 0 = repeat forever
+    volatile bool running;
+    volatile bool done;
+#ifdef ESP32
+    hw_timer_t* timer;
+    uint64_t alarmTime;    // timer count of the next step, in microseconds since the start
+#else
+    uint32_t nextDelay();
+
+    uint32_t nextStepTime; // micros()
+    uint32_t stepDelay;
+    bool reportedLate;
+#endif
+};
+
+#endif
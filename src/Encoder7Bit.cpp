@@ -61,4 +61,30 @@ void Encoder7BitClass::readBinary(int outBytes, byte *inData, byte *outData)
   }
 }
 
+BitStreamEncoder::BitStreamEncoder()
+{
+  pending = 0;
+  pendingBits = 0;
+}
+
+void BitStreamEncoder::write(uint32_t value, byte bits)
+{
+  pending |= (value & ((1UL << bits) - 1)) << pendingBits;
+  pendingBits += bits;
+  while (pendingBits >= 7) {
+    Firmata.write((byte)(pending & 0x7F));
+    pending >>= 7;
+    pendingBits -= 7;
+  }
+}
+
+void BitStreamEncoder::flush()
+{
+  if (pendingBits > 0) {
+    Firmata.write((byte)(pending & 0x7F));
+  }
+  pending = 0;
+  pendingBits = 0;
+}
+
 Encoder7BitClass Encoder7Bit;
@@ -35,4 +35,19 @@ class Encoder7BitClass
     int shift;
 };
 
+/*
+ * Writes values of up to 24 bits as a continuous bit stream, LSB first, 7 bits per byte.
+ */
+class BitStreamEncoder
+{
+  public:
+    BitStreamEncoder();
+    void write(uint32_t value, byte bits);
+    void flush();
+
+  private:
+    uint32_t pending;
+    byte pendingBits;
+};
+
 #endif
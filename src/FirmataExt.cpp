@@ -196,6 +196,18 @@ bool FirmataExt::handleSystemVariableQuery(bool write, SystemVariableDataType* d
         *status = SystemVariableError::NoError;
         return true;
     }
+    if (variable_id == 3)
+    {
+        // Minimum time between two REPORT_TIMESTAMP messages in microseconds, 0 to disable timestamps
+        if (write)
+        {
+            Firmata.setTimestampResolution(*value < 0 ? 0 : (uint32_t)*value);
+        }
+        *value = (int)Firmata.getTimestampResolution();
+        *data_type = SystemVariableDataType::Int;
+        *status = SystemVariableError::NoError;
+        return true;
+    }
 
 	return false;
 }
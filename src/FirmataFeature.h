@@ -31,7 +31,7 @@ class FirmataFeature
     /// Regularly called by main thread
     /// </summary>
     /// <param name="elapsed">True if the default reporting time has elapsed, false otherwise. Components wishing to report status in
-    /// a regular interval should not do anything if this is false.</param>
+    /// a regular interval should not do anything if this is false, unless they have an individual interval configured (see ReportTimer).</param>
     virtual void report(bool elapsed)
     {
       // Empty by default
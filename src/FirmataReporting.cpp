@@ -36,7 +36,8 @@ boolean FirmataReporting::handlePinMode(byte pin, int mode)
 boolean FirmataReporting::handleSysex(byte command, byte argc, byte* argv)
 {
   if (command == SAMPLING_INTERVAL) {
-    if (argc > 1) {
+    // Intervals for individual channels are handled by the respective features
+    if (argc > 1 && (argc < 4 || argv[2] == SAMPLING_INTERVAL_GLOBAL)) {
       samplingInterval = argv[0] + (argv[1] << 7);
       if (samplingInterval < MINIMUM_SAMPLING_INTERVAL) {
         samplingInterval = MINIMUM_SAMPLING_INTERVAL;
@@ -44,7 +45,7 @@ boolean FirmataReporting::handleSysex(byte command, byte argc, byte* argv)
       return true;
     }
   }
-  if (command == SAMPLING_INTERVAL_QUERY) {
+  if (command == SAMPLING_INTERVAL_QUERY && (argc < 2 || argv[0] == SAMPLING_INTERVAL_GLOBAL)) {
     Firmata.startSysex();
     Firmata.write(SAMPLING_INTERVAL);
     Firmata.sendPackedUInt14(samplingInterval);
@@ -54,6 +55,19 @@ boolean FirmataReporting::handleSysex(byte command, byte argc, byte* argv)
   return false;
 }
 
+/**
+ * Reply to a SAMPLING_INTERVAL_QUERY for an individual report source.
+ */
+void FirmataReporting::sendSamplingInterval(uint16_t interval, byte target, byte index)
+{
+  Firmata.startSysex();
+  Firmata.write(SAMPLING_INTERVAL);
+  Firmata.sendPackedUInt14(interval);
+  Firmata.write(target);
+  Firmata.write(index);
+  Firmata.endSysex();
+}
+
 boolean FirmataReporting::elapsed()
 {
   currentMillis = millis();
@@ -24,6 +24,77 @@
 
 #define MINIMUM_SAMPLING_INTERVAL 1
 
+// Targets of an extended SAMPLING_INTERVAL message. The extended message is
+// SAMPLING_INTERVAL, interval LSB, interval MSB, target, index
+// where index is the analog channel, the digital port or the i2c query slot.
+// An interval of 0 makes the target follow the global sampling interval again.
+#define SAMPLING_INTERVAL_GLOBAL        0x00
+#define SAMPLING_INTERVAL_ANALOG        0x01
+#define SAMPLING_INTERVAL_DIGITAL_PORT  0x02
+#define SAMPLING_INTERVAL_I2C_QUERY     0x03
+
+/// <summary>
+/// Decides whether a single report source (an analog channel, a digital port, an i2c query...) is due.
+/// Only the lower 16 bits of millis() are kept, which is enough because intervals are limited to 14 bits.
+/// </summary>
+class ReportTimer
+{
+  public:
+    ReportTimer()
+    {
+      interval = 0;
+      lastReport = 0;
+    }
+
+    void setInterval(uint16_t ms)
+    {
+      interval = ms;
+      lastReport = (uint16_t)millis();
+    }
+
+    uint16_t getInterval()
+    {
+      return interval;
+    }
+
+    /// <summary>
+    /// Starts a new interval at the given time
+    /// </summary>
+    void restart(uint32_t now)
+    {
+      lastReport = (uint16_t)now;
+    }
+
+    /// <summary>
+    /// Returns true if the source shall report now.
+    /// </summary>
+    /// <param name="elapsed">Value to return if no individual interval is set</param>
+    /// <param name="now">The current value of millis()</param>
+    bool isDue(bool elapsed, uint32_t now)
+    {
+      if (interval == 0)
+      {
+        return elapsed;
+      }
+      uint16_t now16 = (uint16_t)now;
+      if ((uint16_t)(now16 - lastReport) < interval)
+      {
+        return false;
+      }
+      lastReport += interval;
+      if ((uint16_t)(now16 - lastReport) >= interval)
+      {
+        // We're late by more than one interval, don't try to catch up
+        lastReport = now16;
+      }
+      return true;
+    }
+
+  private:
+    uint16_t interval;
+    uint16_t lastReport;
+};
+
 class FirmataReporting: public FirmataFeature
 {
   public:
@@ -40,6 +111,8 @@ class FirmataReporting: public FirmataFeature
     void reset();
 
     boolean elapsed();
+
+    static void sendSamplingInterval(uint16_t interval, byte target, byte index);
   private:
 
     /* timer variables */
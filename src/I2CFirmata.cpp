@@ -7,58 +7,332 @@
 #include "ConfigurableFirmata.h"
 #include "Wire.h"
 #include "I2CFirmata.h"
+#include "Encoder7Bit.h"
+
+#if defined(BUFFER_LENGTH) && BUFFER_LENGTH < I2C_CHUNK_SIZE
+#error I2C_CHUNK_SIZE is larger than the buffer of the Wire library
+#endif
 
 I2CFirmata::I2CFirmata()
 	: query()
 {
     isI2CEnabled = false;
-    queryIndex = -1;
+    queryCount = 0;
+    hasQueryIntervals = false;
     i2cReadDelayTime = 0;  // default delay time between i2c read request and Wire.requestFrom()
-    memset(i2cRxData, 0, 32);
+    memset(i2cRxData, 0, sizeof(i2cRxData));
+    packedReplies = false;
+    hasCurrentJob = false;
+    hasTransaction = false;
+    busFreeTime = 0;
+    busWaiting = false;
+}
+
+bool I2CFirmata::queueRead(byte address, int theRegister, uint16_t numBytes, byte stopTX, byte seqenceNo, byte slot)
+{
+  i2c_job job;
+  job.mode = I2C_READ;
+  job.addr = address;
+  job.reg = theRegister;
+  job.bytes = numBytes;
+  job.offset = 0;
+  job.stopTX = stopTX;
+  job.sequenceNo = seqenceNo;
+  job.slot = slot;
+  return jobs.push(job);
+}
+
+void I2CFirmata::waitForBus(uint32_t time)
+{
+  busFreeTime = micros() + time;
+  busWaiting = true;
 }
 
-void I2CFirmata::readAndReportData(byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo) {
-  // allow I2C requests that don't require a register read
-  // for example, some devices using an interrupt pin to signify new data available
-  // do not always require the register read so upon interrupt you call Wire.requestFrom()
-  if (theRegister != I2C_REGISTER_NOT_SPECIFIED) {
-    Wire.beginTransmission(address);
-    Wire.write((byte)theRegister);
-    Wire.endTransmission(stopTX); // default = true
-    // do not set a value of 0
-    if (i2cReadDelayTime > 0) {
-      // delay is necessary for some devices such as WiiNunchuck
-      delayMicroseconds(i2cReadDelayTime);
+/*
+ * Runs the queued transfers until one has to wait. The transfers themselves use the (blocking) Wire library,
+ * but the delays between them are scheduled, so the loop keeps running.
+ */
+void I2CFirmata::runJobs()
+{
+  for (byte n = 0; n < I2C_JOBS_PER_LOOP; n++) {
+    if (busWaiting) {
+      // Only compared while waiting: an old time would look like a future one after 2^31 us
+      if ((int32_t)(micros() - busFreeTime) < 0) {
+        return;
+      }
+      busWaiting = false;
+    }
+    if (hasCurrentJob) {
+      if (currentJob.mode == I2C_JOB_TRANSACTION) {
+        hasCurrentJob = !runTransaction();
+      }
+      else {
+        // One chunk per step, so a long read doesn't block the loop for all of its time
+        hasCurrentJob = !readAndReportData(currentJob);
+      }
+      continue;
+    }
+
+    i2c_job job;
+    if (!jobs.pop(job)) {
+      return;
+    }
+    if (job.mode == I2C_WRITE) {
+      runWrite(job);
+      waitForBus(I2C_WRITE_GAP);
+      continue;
     }
+    if (job.mode == I2C_JOB_TRANSACTION) {
+      currentJob = job;
+      hasCurrentJob = true;
+      continue;
+    }
+
+    // allow I2C requests that don't require a register read
+    // for example, some devices using an interrupt pin to signify new data available
+    // do not always require the register read so upon interrupt you call Wire.requestFrom()
+    if (job.reg != I2C_REGISTER_NOT_SPECIFIED) {
+      Wire.beginTransmission(job.addr);
+      Wire.write((byte)job.reg);
+      Wire.endTransmission(job.stopTX); // default = true
+      // do not set a value of 0
+      if (i2cReadDelayTime > 0) {
+        // delay is necessary for some devices such as WiiNunchuck
+        waitForBus(i2cReadDelayTime);
+      }
+    }
+    currentJob = job;
+    hasCurrentJob = true;
   }
-  else {
+}
+
+void I2CFirmata::runWrite(const i2c_job& job)
+{
+  Wire.beginTransmission(job.addr);
+  for (byte i = 0; i < job.bytes; i++) {
+    byte data = 0;
+    writeData.pop(data);
+    Wire.write(data);
+  }
+  Wire.endTransmission();
+}
+
+/*
+ * Reads and reports the next chunk of the job. Returns true if the job is complete.
+ */
+bool I2CFirmata::readAndReportData(i2c_job& job) {
+  int theRegister = job.reg;
+  if (theRegister == I2C_REGISTER_NOT_SPECIFIED) {
     theRegister = 0;  // fill the register with a dummy value
   }
+  theRegister += job.offset;
 
-  Wire.requestFrom(address, numBytes);  // all bytes are returned in requestFrom
+  byte numBytes = (byte)min(job.bytes - job.offset, I2C_CHUNK_SIZE);
+  Wire.requestFrom(job.addr, numBytes);  // all bytes are returned in requestFrom
 
   // check to be sure correct number of bytes were returned by slave
+  byte received = numBytes;
   if (numBytes < Wire.available()) {
     Firmata.sendString(F("I2C: Too many bytes received"));
   }
   else if (numBytes > Wire.available()) {
     // Firmata.sendString(F("I2C: Too few bytes received"));
-    numBytes = Wire.available();
+    received = Wire.available();
   }
 
-  i2cRxData[0] = (byte)theRegister;
+  for (int i = 0; i < received && Wire.available(); i++) {
+    i2cRxData[i] = Wire.read();
+  }
 
-  for (int i = 0; i < numBytes && Wire.available(); i++) {
-    i2cRxData[1 + i] = Wire.read();
+  job.offset += numBytes;
+  bool complete = received < numBytes || job.offset >= job.bytes;
+  if (job.slot != I2C_NO_SLOT && isReplyUnchanged(job.slot, received)) {
+    return complete;
   }
 
   // send slave address, register and received bytes
+  Firmata.sendTimestampIfDue();
   Firmata.startSysex();
   Firmata.write(I2C_REPLY);
-  Firmata.write(address); // Slave address, LSB (always < 128 in 7 bit mode)
-  Firmata.write(seqenceNo); // Slave address, MSB. This is abused here, but a client that doesn't use the sequencing will always send 0 and be happy
-  for (int i = 0; i < numBytes + 1; i++) {
+  Firmata.write(job.addr); // Slave address, LSB (always < 128 in 7 bit mode)
+  Firmata.write(job.sequenceNo); // Slave address, MSB. This is abused here, but a client that doesn't use the sequencing will always send 0 and be happy
+  Firmata.sendValueAsTwo7bitBytes(theRegister);
+  if (packedReplies) {
+    Encoder7BitClass encoder;
+    encoder.startBinaryWrite();
+    for (int i = 0; i < received; i++) {
+      encoder.writeBinary(i2cRxData[i]);
+    }
+    encoder.endBinaryWrite();
+  }
+  else {
+    for (int i = 0; i < received; i++) {
       Firmata.sendValueAsTwo7bitBytes(i2cRxData[i]);
+    }
+  }
+  Firmata.endSysex();
+
+  // A device that sent less than requested has no more data
+  return complete;
+}
+
+/*
+ * For a query with I2C_QUERY_ON_CHANGE: returns true if the reply in i2cRxData is the same as the last one
+ * and the heartbeat hasn't elapsed, so it doesn't need to be sent.
+ */
+bool I2CFirmata::isReplyUnchanged(byte slot, byte numBytes)
+{
+  i2c_device_info& q = query[slot];
+  if (!q.active || (q.flags & I2C_QUERY_ON_CHANGE) == 0) {
+    return false;
+  }
+  // FNV-1a
+  uint32_t hash = 2166136261UL;
+  for (byte i = 0; i < numBytes; i++) {
+    hash = (hash ^ i2cRxData[i]) * 16777619UL;
+  }
+  hash ^= numBytes;
+  uint32_t now = millis();
+  if (q.hasLastReply && hash == q.lastReplyHash && (q.heartbeat == 0 || now - q.lastReplyTime < q.heartbeat * 1000UL)) {
+    return true;
+  }
+  q.hasLastReply = true;
+  q.lastReplyHash = hash;
+  q.lastReplyTime = now;
+  return false;
+}
+
+/*
+ * Checks the operations of an I2C_TRANSACTION_RUN message and queues the transaction
+ */
+void I2CFirmata::queueTransaction(byte argc, byte* argv)
+{
+  if (hasTransaction || jobs.space() == 0) {
+    Firmata.sendString(F("I2C: Queue full"));
+    return;
+  }
+  if (argc < 2 || argc - 2 > I2C_TRANSACTION_SIZE) {
+    Firmata.sendString(F("I2C: Invalid transaction"));
+    return;
+  }
+  byte length = argc - 2;
+  byte* ops = argv + 2;
+  byte numOps = 0;
+  uint16_t readLength = 0;
+  byte i = 0;
+  while (i < length) {
+    uint16_t size;
+    switch (ops[i]) {
+    case I2C_OP_WRITE:
+      // Wire would drop the bytes that don't fit into its buffer and still report success
+      size = i + 3 < length && ops[i + 3] <= I2C_CHUNK_SIZE ? 4 + 2 * ops[i + 3] : 0;
+      break;
+    case I2C_OP_READ:
+      size = 5;
+      if (i + 4 < length) {
+        uint16_t bytes = Firmata.decodePackedUInt14(ops + i + 3);
+        readLength += bytes;
+        if (bytes > I2C_CHUNK_SIZE) {
+          size = 0;
+        }
+      }
+      break;
+    case I2C_OP_DELAY:
+      size = 3;
+      break;
+    default:
+      size = 0;
+      break;
+    }
+    if (size == 0 || i + size > length || ++numOps > I2C_TRANSACTION_MAX_OPS || readLength > I2C_TRANSACTION_MAX_READ) {
+      Firmata.sendString(F("I2C: Invalid transaction"));
+      return;
+    }
+    i += size;
+  }
+
+  memcpy(transaction, ops, length);
+  transactionLength = length;
+  transactionPosition = 0;
+  transactionSequenceNo = argv[1];
+  transactionOps = 0;
+  transactionReadLength = 0;
+  hasTransaction = true;
+  i2c_job job;
+  job.mode = I2C_JOB_TRANSACTION;
+  jobs.push(job);
+}
+
+/*
+ * Runs the operations of the transaction up to the next delay. Returns true when the transaction is complete.
+ */
+bool I2CFirmata::runTransaction()
+{
+  while (transactionPosition < transactionLength) {
+    byte* op = transaction + transactionPosition;
+    byte status = 0;
+    if (op[0] == I2C_OP_DELAY) {
+      transactionStatus[transactionOps++] = 0;
+      transactionPosition += 3;
+      waitForBus(Firmata.decodePackedUInt14(op + 1));
+      return false;
+    }
+    byte address = op[1];
+    bool stop = (op[2] & I2C_OP_RESTART) == 0;
+    if (op[0] == I2C_OP_WRITE) {
+      byte count = op[3];
+      Wire.beginTransmission(address);
+      for (byte i = 0; i < count; i++) {
+        Wire.write((byte)(op[4 + 2 * i] + (op[5 + 2 * i] << 7)));
+      }
+      status = Wire.endTransmission(stop);
+      transactionPosition += 4 + 2 * count;
+    }
+    else {
+      byte count = (byte)Firmata.decodePackedUInt14(op + 3);
+      Wire.requestFrom(address, count, (uint8_t)stop);
+      byte received = 0;
+      while (received < count && Wire.available()) {
+        transactionReadData()[transactionReadLength++] = Wire.read();
+        received++;
+      }
+      status = received < count ? I2C_STATUS_SHORT_READ : 0;
+      transactionPosition += 5;
+    }
+    transactionStatus[transactionOps++] = status;
+    if (status != 0) {
+      break;
+    }
+  }
+  sendTransactionReply();
+  hasTransaction = false;
+  return true;
+}
+
+void I2CFirmata::sendTransactionReply()
+{
+  Firmata.sendTimestampIfDue();
+  Firmata.startSysex();
+  Firmata.write(I2C_TRANSACTION);
+  Firmata.write(I2C_TRANSACTION_REPLY);
+  Firmata.write(transactionSequenceNo);
+  Firmata.write(transactionOps);
+  for (byte i = 0; i < transactionOps; i++) {
+    Firmata.write(transactionStatus[i]);
+  }
+  byte* data = transactionReadData();
+  if (packedReplies) {
+    Encoder7BitClass encoder;
+    encoder.startBinaryWrite();
+    for (uint16_t i = 0; i < transactionReadLength; i++) {
+      encoder.writeBinary(data[i]);
+    }
+    encoder.endBinaryWrite();
+  }
+  else {
+    for (uint16_t i = 0; i < transactionReadLength; i++) {
+      Firmata.sendValueAsTwo7bitBytes(data[i]);
+    }
   }
   Firmata.endSysex();
 }
@@ -100,6 +374,29 @@ boolean I2CFirmata::handleSysex(byte command, byte argc, byte* argv)
     break;
   case I2C_CONFIG:
     return handleI2CConfig(argc, argv);
+  case I2C_TRANSACTION:
+    if (isI2CEnabled && argc > 0 && argv[0] == I2C_TRANSACTION_RUN) {
+      queueTransaction(argc, argv);
+      return true;
+    }
+    break;
+  case SAMPLING_INTERVAL:
+    if (argc >= 4 && argv[2] == SAMPLING_INTERVAL_I2C_QUERY) {
+      if (argv[3] < I2C_MAX_QUERIES && query[argv[3]].active) {
+        query[argv[3]].timer.setInterval(Firmata.decodePackedUInt14(argv));
+        updateIntervalFlag();
+      }
+      return true;
+    }
+    break;
+  case SAMPLING_INTERVAL_QUERY:
+    if (argc >= 2 && argv[0] == SAMPLING_INTERVAL_I2C_QUERY) {
+      if (argv[1] < I2C_MAX_QUERIES && query[argv[1]].active) {
+        FirmataReporting::sendSamplingInterval(query[argv[1]].timer.getInterval(), SAMPLING_INTERVAL_I2C_QUERY, argv[1]);
+      }
+      return true;
+    }
+    break;
   }
   return false;
 }
@@ -110,6 +407,7 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
   byte stopTX;
   byte slaveAddress;
   byte data;
+  uint16_t numBytes;
   int slaveRegister;
   mode = argv[1] & I2C_READ_WRITE_MODE_MASK;
   if (argv[1] & I2C_10BIT_ADDRESS_MODE_MASK) {
@@ -133,84 +431,129 @@ void I2CFirmata::handleI2CRequest(byte argc, byte* argv)
 
   switch (mode) {
   case I2C_WRITE:
-    Wire.beginTransmission(slaveAddress);
-    for (byte i = 2; i < argc; i += 2) {
+  {
+    i2c_job job;
+    job.mode = I2C_WRITE;
+    job.addr = slaveAddress;
+    job.bytes = (argc - 2) / 2;
+    if (jobs.space() == 0 || writeData.space() < job.bytes) {
+      Firmata.sendString(F("I2C: Queue full"));
+      break;
+    }
+    for (byte i = 2; i + 1 < argc; i += 2) {
       data = argv[i] + (argv[i + 1] << 7);
-      Wire.write(data);
+      writeData.push(data);
     }
-    Wire.endTransmission();
-    delayMicroseconds(70);
+    jobs.push(job);
     break;
+  }
   case I2C_READ:
     if (argc == 6) {
       // a slave register is specified
       slaveRegister = argv[2] + (argv[3] << 7);
-      data = argv[4] + (argv[5] << 7);  // bytes to read
+      numBytes = argv[4] + (argv[5] << 7);  // bytes to read
     }
     else {
       // a slave register is NOT specified
       slaveRegister = I2C_REGISTER_NOT_SPECIFIED;
-      data = argv[2] + (argv[3] << 7);  // bytes to read
+      numBytes = argv[2] + (argv[3] << 7);  // bytes to read
+    }
+    if (!queueRead(slaveAddress, (int)slaveRegister, numBytes, stopTX, sequenceNo, I2C_NO_SLOT)) {
+      Firmata.sendString(F("I2C: Queue full"));
     }
-    readAndReportData(slaveAddress, (int)slaveRegister, data, stopTX, sequenceNo);
     break;
   case I2C_READ_CONTINUOUSLY:
-    if ((queryIndex + 1) >= I2C_MAX_QUERIES) {
-      // too many queries, just ignore
-      Firmata.sendString(F("too many queries"));
-      break;
+  {
+    // Without register: bytes (2), [slot, interval (2), [flags, heartbeat (2)]].
+    // With register: register (2), bytes (2), [slot, interval (2), [flags, heartbeat (2)]]
+    byte slot = I2C_MAX_QUERIES;
+    uint16_t interval = 0;
+    byte flags = 0;
+    uint16_t heartbeat = 0;
+    if (argc == 10 || argc == 12) {
+      flags = argv[argc - 3];
+      heartbeat = Firmata.decodePackedUInt14(argv + argc - 2);
+      argc -= 3;
+    }
+    if (argc == 7 || argc == 9) {
+      slot = argv[argc - 3];
+      interval = Firmata.decodePackedUInt14(argv + argc - 2);
+      argc -= 3;
+      if (slot >= I2C_MAX_QUERIES) {
+        Firmata.sendString(F("invalid query slot"));
+        break;
+      }
+    }
+    else {
+      for (slot = 0; slot < I2C_MAX_QUERIES && query[slot].active; slot++) {
+      }
+      if (slot == I2C_MAX_QUERIES) {
+        // too many queries, just ignore
+        Firmata.sendString(F("too many queries"));
+        break;
+      }
     }
     if (argc == 6) {
       // a slave register is specified
       slaveRegister = argv[2] + (argv[3] << 7);
-      data = argv[4] + (argv[5] << 7);  // bytes to read
+      numBytes = argv[4] + (argv[5] << 7);  // bytes to read
     }
     else {
       // a slave register is NOT specified
       slaveRegister = (int)I2C_REGISTER_NOT_SPECIFIED;
-      data = argv[2] + (argv[3] << 7);  // bytes to read
+      numBytes = argv[2] + (argv[3] << 7);  // bytes to read
+    }
+    if (!query[slot].active) {
+      queryCount++;
+    }
+    query[slot].active = true;
+    query[slot].addr = slaveAddress;
+    query[slot].reg = slaveRegister;
+    query[slot].bytes = numBytes;
+    query[slot].stopTX = stopTX;
+    query[slot].timer.setInterval(interval);
+    updateIntervalFlag();
+    query[slot].flags = flags;
+    query[slot].heartbeat = heartbeat;
+    query[slot].hasLastReply = false;
+    if ((flags & I2C_QUERY_ON_CHANGE) && numBytes > I2C_CHUNK_SIZE) {
+      // Each chunk is a reply of its own, only one reply per query is compared
+      query[slot].flags &= ~I2C_QUERY_ON_CHANGE;
+      Firmata.sendString(F("I2C: Query too long to report on change"));
     }
-    queryIndex++;
-    query[queryIndex].addr = slaveAddress;
-    query[queryIndex].reg = slaveRegister;
-    query[queryIndex].bytes = data;
-    query[queryIndex].stopTX = stopTX;
     break;
+  }
   case I2C_STOP_READING:
-    byte queryIndexToSkip;
-    // if read continuous mode is enabled for only 1 i2c device, disable
-    // read continuous reporting for that device
-    if (queryIndex <= 0) {
-      queryIndex = -1;
+  {
+    byte slot = 0;
+    if (argc > 2) {
+      slot = argv[2];
     }
     else {
-      queryIndexToSkip = 0;
-      // if read continuous mode is enabled for multiple devices,
-      // determine which device to stop reading and remove it's data from
-      // the array, shifiting other array data to fill the space
-      for (byte i = 0; i < queryIndex + 1; i++) {
-        if (query[i].addr == slaveAddress) {
-          queryIndexToSkip = i;
-          break;
-        }
-      }
-
-      for (byte i = queryIndexToSkip; i < queryIndex + 1; i++) {
-        if (i < I2C_MAX_QUERIES) {
-          query[i].addr = query[i + 1].addr;
-          query[i].reg = query[i + 1].reg;
-          query[i].bytes = query[i + 1].bytes;
-          query[i].stopTX = query[i + 1].stopTX;
-        }
+      while (slot < I2C_MAX_QUERIES && !(query[slot].active && query[slot].addr == slaveAddress)) {
+        slot++;
       }
-      queryIndex--;
+    }
+    if (slot < I2C_MAX_QUERIES && query[slot].active) {
+      query[slot].active = false;
+      queryCount--;
+      updateIntervalFlag();
     }
     break;
+  }
   default:
     break;
   }
 }
 
+void I2CFirmata::updateIntervalFlag()
+{
+  hasQueryIntervals = false;
+  for (byte i = 0; i < I2C_MAX_QUERIES; i++) {
+    hasQueryIntervals |= query[i].active && query[i].timer.getInterval() > 0;
+  }
+}
+
 boolean I2CFirmata::handleI2CConfig(byte argc, byte* argv)
 {
   unsigned int delayTime = (argv[0] + (argv[1] << 7));
@@ -218,6 +561,9 @@ boolean I2CFirmata::handleI2CConfig(byte argc, byte* argv)
   if (delayTime > 0) {
     i2cReadDelayTime = delayTime;
   }
+  if (argc > 2) {
+    packedReplies = (argv[2] & I2C_CONFIG_PACKED_REPLIES) != 0;
+  }
 
   if (!isI2CEnabled) {
     enableI2CPins();
@@ -259,7 +605,17 @@ void I2CFirmata::disableI2CPins()
 {
   isI2CEnabled = false;
   // disable read continuous mode for all devices
-  queryIndex = -1;
+  for (byte i = 0; i < I2C_MAX_QUERIES; i++) {
+    query[i].active = false;
+  }
+  queryCount = 0;
+  hasQueryIntervals = false;
+  jobs.clear();
+  writeData.clear();
+  hasCurrentJob = false;
+  hasTransaction = false;
+  busWaiting = false;
+  packedReplies = false;
   // uncomment the following if or when the end() method is added to Wire library
   // Wire.end();
 }
@@ -273,14 +629,19 @@ void I2CFirmata::reset()
 
 void I2CFirmata::report(bool elapsed)
 {
-  // report i2c data for all device with read continuous mode enabled
-  if (!elapsed)
-  {
+  if (!isI2CEnabled) {
     return;
   }
-  if (queryIndex > -1) {
-    for (byte i = 0; i < queryIndex + 1; i++) {
-      readAndReportData(query[i].addr, query[i].reg, query[i].bytes, query[i].stopTX, 0);
+  // queue i2c reads for all devices with read continuous mode enabled
+  if ((elapsed || hasQueryIntervals) && queryCount > 0) {
+    uint32_t now = millis();
+    for (byte i = 0; i < I2C_MAX_QUERIES; i++) {
+      if (!query[i].active || !query[i].timer.isDue(elapsed, now)) {
+        continue;
+      }
+      // When the queue is full, this query is skipped until it is due again
+      queueRead(query[i].addr, query[i].reg, query[i].bytes, query[i].stopTX, 0, i);
     }
   }
+  runJobs();
 }
@@ -25,6 +25,7 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 #include "FirmataReporting.h"
+#include "utility/SampleRingBuffer.h"
 
 #define I2C_WRITE                   0B00000000
 #define I2C_READ                    0B00001000
@@ -36,17 +37,104 @@
 #define I2C_10BIT_ADDRESS_MASK      0B00000111
 #define I2C_STOP_TX                 1
 #define I2C_RESTART_TX              0
+#ifndef I2C_MAX_QUERIES
+#ifdef LARGE_MEM_DEVICE
+#define I2C_MAX_QUERIES             32
+#else
 #define I2C_MAX_QUERIES             8
+#endif
+#endif
 #define I2C_REGISTER_NOT_SPECIFIED  -1
+#define I2C_WRITE_GAP               70 // us after a write before the next transfer
+
+// Queued transfers and the data of the queued writes. Both sizes must be powers of 2.
+#ifndef I2C_JOB_QUEUE_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define I2C_JOB_QUEUE_SIZE          32
+#define I2C_WRITE_BUFFER_SIZE       256
+#else
+#define I2C_JOB_QUEUE_SIZE          4
+#define I2C_WRITE_BUFFER_SIZE       32
+#endif
+#endif
+#define I2C_JOBS_PER_LOOP           4
+
+// Reads longer than the buffer of the Wire library are done in chunks. Each chunk is sent as its own I2C_REPLY,
+// with the register (or 0 if not specified) plus the offset of the chunk as the register.
+#ifndef I2C_CHUNK_SIZE
+#ifdef ESP32
+#define I2C_CHUNK_SIZE              128
+#else
+#define I2C_CHUNK_SIZE              32
+#endif
+#endif
+
+// Subcommands of I2C_TRANSACTION
+#define I2C_TRANSACTION_RUN         0x00 // sequence number, then the operations. Replied with I2C_TRANSACTION_REPLY.
+#define I2C_TRANSACTION_REPLY       0x01 // reply: sequence number, number of operations done, the status of each operation,
+                                         // then the data of all reads (packed if I2C_CONFIG_PACKED_REPLIES is set)
+// Operations of I2C_TRANSACTION_RUN. The transaction stops at the first operation that fails.
+#define I2C_OP_WRITE                0x00 // address, flags, number of bytes (at most I2C_CHUNK_SIZE), bytes (2 bytes each)
+#define I2C_OP_READ                 0x01 // address, flags, number of bytes (at most I2C_CHUNK_SIZE)
+#define I2C_OP_DELAY                0x02 // microseconds (2 bytes). Doesn't block the loop.
+#define I2C_OP_RESTART              0x01 // flag: end without stop condition, so the next operation starts with a repeated start
+// Status of an operation: 0 if ok, 1-4 like Wire.endTransmission(), or:
+#define I2C_STATUS_SHORT_READ       0x05 // the device sent fewer bytes than requested
+
+#ifndef I2C_TRANSACTION_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define I2C_TRANSACTION_SIZE        MAX_DATA_BYTES // bytes of operations
+#define I2C_TRANSACTION_MAX_OPS     32
+#define I2C_TRANSACTION_MAX_READ    256            // bytes read by all operations
+#else
+#define I2C_TRANSACTION_SIZE        32
+#define I2C_TRANSACTION_MAX_OPS     8
+#define I2C_TRANSACTION_MAX_READ    32
+#endif
+#endif
+#define I2C_JOB_TRANSACTION         0x80 // mode of the job of a transaction
+
+// Options of I2C_CONFIG, after the read delay
+#define I2C_CONFIG_PACKED_REPLIES   0x01 // I2C_REPLY data as a 7 bit packed stream (like SPI_REPLY with packed data) instead of two bytes per byte
 
 /* i2c data */
 struct i2c_device_info {
+  bool active;
   byte addr;
   int reg;
-  byte bytes;
+  uint16_t bytes;
   byte stopTX;
+  ReportTimer timer;
+  byte flags;              // I2C_QUERY_*
+  uint16_t heartbeat;      // s, with I2C_QUERY_ON_CHANGE
+  bool hasLastReply;
+  uint32_t lastReplyHash;
+  uint32_t lastReplyTime;  // millis()
 };
 
+// Flags of a continuous query
+#define I2C_QUERY_ON_CHANGE         0x01 // only reply when the data differs from the last reply, or the heartbeat has elapsed
+#define I2C_NO_SLOT                 0xFF
+
+/*
+ * I2C_READ_CONTINUOUSLY optionally takes the slot of the query and its interval in ms (2 bytes), after the
+ * number of bytes, and optionally after that the flags of the query and the heartbeat in seconds (2 bytes, 0 for none).
+ * A query in the same slot is replaced. The interval can be changed later with
+ * SAMPLING_INTERVAL for the slot. Without a slot, the first free slot is used.
+ * I2C_STOP_READING optionally takes the slot to stop; without it, the first query for the address is stopped.
+ */
+
+/* A queued transfer */
+struct i2c_job {
+  byte mode;       // I2C_WRITE or I2C_READ
+  byte addr;
+  int reg;
+  uint16_t bytes;  // to read, or to write (taken from the write buffer)
+  uint16_t offset; // bytes read so far
+  byte stopTX;
+  byte sequenceNo;
+  byte slot;       // of the continuous query, I2C_NO_SLOT if none
+};
 class I2CFirmata: public FirmataFeature
 {
   public:
@@ -61,12 +149,53 @@ class I2CFirmata: public FirmataFeature
     /* for i2c read continuous more */
     i2c_device_info query[I2C_MAX_QUERIES];
 
-    byte i2cRxData[32];
+    byte i2cRxData[I2C_CHUNK_SIZE];
     boolean isI2CEnabled;
-    signed char queryIndex;
+    bool packedReplies;
+    byte queryCount; // active queries
+    bool hasQueryIntervals; // true if any query has its own sampling interval
     unsigned int i2cReadDelayTime;  // default delay time between i2c read request and Wire.requestFrom()
 
-    void readAndReportData(byte address, int theRegister, byte numBytes, byte stopTX, byte seqenceNo);
+    /* Transfers are queued and run from report(). Waits (the read delay, the gap after a write) don't block the loop. */
+    SampleRingBuffer<i2c_job, I2C_JOB_QUEUE_SIZE> jobs;
+    SampleRingBuffer<byte, I2C_WRITE_BUFFER_SIZE> writeData;
+    i2c_job currentJob;     // a read with the register written, waiting for the read delay or for the next chunk
+    bool hasCurrentJob;
+
+    /* The transaction that is queued or running. Only one at a time. */
+    byte transaction[I2C_TRANSACTION_SIZE];
+    byte transactionLength;
+    byte transactionPosition;
+    byte transactionSequenceNo;
+    byte transactionStatus[I2C_TRANSACTION_MAX_OPS];
+    byte transactionOps;    // done so far
+#if I2C_TRANSACTION_MAX_READ > I2C_CHUNK_SIZE
+    byte transactionRead[I2C_TRANSACTION_MAX_READ];
+#endif
+    uint16_t transactionReadLength;
+    bool hasTransaction;
+    uint32_t busFreeTime;   // micros() from when on the next transfer may start
+    bool busWaiting;        // busFreeTime is only valid while set
+
+    bool queueRead(byte address, int theRegister, uint16_t numBytes, byte stopTX, byte seqenceNo, byte slot);
+    bool isReplyUnchanged(byte slot, byte numBytes);
+    void waitForBus(uint32_t time);
+    void runJobs();
+    void updateIntervalFlag();
+    void runWrite(const i2c_job& job);
+    bool readAndReportData(i2c_job& job);
+    void queueTransaction(byte argc, byte* argv);
+    bool runTransaction();
+    void sendTransactionReply();
+    byte* transactionReadData()
+    {
+#if I2C_TRANSACTION_MAX_READ > I2C_CHUNK_SIZE
+      return transactionRead;
+#else
+      // No other read runs while a transaction is in progress, so it can use the buffer of the replies
+      return i2cRxData;
+#endif
+    }
     void handleI2CRequest(byte argc, byte *argv);
     boolean handleI2CConfig(byte argc, byte *argv);
     boolean enableI2CPins();
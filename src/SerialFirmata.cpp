@@ -333,6 +333,7 @@ void SerialFirmata::checkSerial()
         }
 
         if (read) {
+          Firmata.sendTimestampIfDue();
           Firmata.write(START_SYSEX);
           Firmata.write(SERIAL_MESSAGE);
           Firmata.write(SERIAL_REPLY | portId);
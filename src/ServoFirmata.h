@@ -26,8 +26,50 @@
 #include <ConfigurableFirmata.h>
 #include "FirmataFeature.h"
 
+// Subcommands of SERVO_MOTION_DATA
+#define SERVO_MOTION_DONE  0x00 // reply: pin, pulse width in microseconds (2 bytes). Sent when a servo with a speed limit reached its target.
+#define SERVO_GROUP_DEFINE 0x01 // group, pins of the members. The members need a speed limit. Without pins, the group is deleted.
+#define SERVO_GROUP_MOVE   0x02 // group, then the new position of each member (2 bytes each, angle or pulse width like EXTENDED_ANALOG)
+#define SERVO_GROUP_DONE   0x03 // reply: group. Sent when all members of a group have reached their target.
+
+#define SERVO_MOTION_INTERVAL 10 // ms between two updates of the moving servos
+
+#ifdef LARGE_MEM_DEVICE
+#define SERVO_MAX_GROUPS        8
+#define SERVO_GROUP_MAX_MEMBERS 8
+#else
+#define SERVO_MAX_GROUPS        4
+#define SERVO_GROUP_MAX_MEMBERS 6
+#endif
+#define SERVO_NO_GROUP 0xFF
+
 void servoAnalogWrite(byte pin, int value);
 
+// Motion profile of a servo with a speed limit. All values in microseconds of pulse width.
+struct servo_motion {
+  int minPulse;
+  int maxPulse;
+  uint32_t maxVelocity;  // per second
+  uint32_t acceleration; // per second^2, 0 for no limit
+  int target;
+  float position;
+  float velocity;
+  float moveVelocity;     // limits of the current move, the velocity is lower than the above in a group move
+  float moveAcceleration;
+  byte group;             // of the current move, SERVO_NO_GROUP if none
+  bool moving;
+};
+
+/*
+ * Controls servos with the Servo library. SERVO_CONFIG can optionally set a speed limit (and an acceleration limit)
+ * per servo, by adding the maximum velocity in microseconds of pulse width per second (3 bytes) and the acceleration
+ * in microseconds per second^2 (3 bytes, 0 for no limit). Then the servo moves to a new position with a trapezoidal
+ * velocity profile and SERVO_MOTION_DONE is sent when it arrives. A velocity of 0 removes the limit.
+ *
+ * Servos with a speed limit can be moved together in a group, like MultiStepper does for steppers. SERVO_GROUP_MOVE
+ * starts all members in the same update. The slowest member keeps its own profile and the others cruise slower,
+ * within their own limits, so all arrive together. Then SERVO_GROUP_DONE is sent.
+ */
 class ServoFirmata: public FirmataFeature
 {
   public:
@@ -37,10 +79,21 @@ class ServoFirmata: public FirmataFeature
     void handleCapability(byte pin);
     boolean handleSysex(byte command, byte argc, byte* argv);
     void reset();
+    void report(bool elapsed) override;
   private:
     Servo *servos[MAX_SERVOS];
+    servo_motion *motions[MAX_SERVOS];
+    uint32_t lastMotionUpdate;
+    byte groupMembers[SERVO_MAX_GROUPS][SERVO_GROUP_MAX_MEMBERS];
+    byte groupSize[SERVO_MAX_GROUPS];
     void attach(byte pin, int minPulse, int maxPulse);
     void detach(byte pin);
+    void setMotionLimits(byte pin, int minPulse, int maxPulse, uint32_t maxVelocity, uint32_t acceleration);
+    void updateMotion(byte pin, float dt);
+    int toMicroseconds(servo_motion* motion, int value);
+    void defineGroup(byte argc, byte* argv);
+    void moveGroup(byte argc, byte* argv);
+    void finishMotion(byte pin);
 };
 
 
@@ -60,6 +113,10 @@ void servoAnalogWrite(byte pin, int value)
 ServoFirmata::ServoFirmata()
 {
   ServoInstance = this;
+  lastMotionUpdate = 0;
+  for (byte i = 0; i < SERVO_MAX_GROUPS; i++) {
+    groupSize[i] = 0;
+  }
 }
 
 boolean ServoFirmata::analogWrite(byte pin, int value)
@@ -67,13 +124,38 @@ boolean ServoFirmata::analogWrite(byte pin, int value)
   if (IS_PIN_SERVO(pin)) {
     Servo *servo = servos[PIN_TO_SERVO(pin)];
     if (servo) {
-      servo->write(value);
+      servo_motion *motion = motions[PIN_TO_SERVO(pin)];
+      if (motion) {
+        if (!motion->moving) {
+          motion->position = servo->readMicroseconds();
+          motion->velocity = 0;
+          motion->moving = true;
+        }
+        motion->target = toMicroseconds(motion, value);
+        motion->moveVelocity = motion->maxVelocity;
+        motion->moveAcceleration = motion->acceleration;
+        motion->group = SERVO_NO_GROUP;
+      } else {
+        servo->write(value);
+      }
       return true;
     }
   }
   return false;
 }
 
+/*
+ * Converts a value for Servo::write() to a pulse width: values below MIN_PULSE_WIDTH are angles.
+ */
+int ServoFirmata::toMicroseconds(servo_motion *motion, int value)
+{
+  if (value < MIN_PULSE_WIDTH) {
+    value = constrain(value, 0, 180);
+    return map(value, 0, 180, motion->minPulse, motion->maxPulse);
+  }
+  return constrain(value, motion->minPulse, motion->maxPulse);
+}
+
 boolean ServoFirmata::handlePinMode(byte pin, int mode)
 {
   if (IS_PIN_SERVO(pin)) {
@@ -97,6 +179,27 @@ void ServoFirmata::handleCapability(byte pin)
 
 boolean ServoFirmata::handleSysex(byte command, byte argc, byte* argv)
 {
+  if (command == EXTENDED_ANALOG && argc > 1 && argv[0] < TOTAL_PINS && Firmata.getPinMode(argv[0]) == PIN_MODE_SERVO) {
+    int value = argv[1];
+    if (argc > 2) value |= (argv[2] << 7);
+    if (argc > 3) value |= (argv[3] << 14);
+    analogWrite(argv[0], value);
+    return true;
+  }
+  if (command == SERVO_MOTION_DATA && argc > 1) {
+    if (argv[1] >= SERVO_MAX_GROUPS) {
+      Firmata.sendString(F("Invalid servo group"));
+      return true;
+    }
+    if (argv[0] == SERVO_GROUP_DEFINE) {
+      defineGroup(argc, argv);
+      return true;
+    }
+    if (argv[0] == SERVO_GROUP_MOVE) {
+      moveGroup(argc, argv);
+      return true;
+    }
+  }
   if (command == SERVO_CONFIG) {
     if (argc > 4) {
       // these vars are here for clarity, they'll optimized away by the compiler
@@ -106,6 +209,11 @@ boolean ServoFirmata::handleSysex(byte command, byte argc, byte* argv)
         int maxPulse = argv[3] + (argv[4] << 7);
         Firmata.setPinMode(pin, PIN_MODE_SERVO);
         attach(pin, minPulse, maxPulse);
+        if (argc > 10) {
+          uint32_t maxVelocity = (uint32_t)argv[5] | ((uint32_t)argv[6] << 7) | ((uint32_t)argv[7] << 14);
+          uint32_t acceleration = (uint32_t)argv[8] | ((uint32_t)argv[9] << 7) | ((uint32_t)argv[10] << 14);
+          setMotionLimits(pin, minPulse, maxPulse, maxVelocity, acceleration);
+        }
         return true;
       }
     }
@@ -143,6 +251,219 @@ void ServoFirmata::detach(byte pin)
     free(servo);
     servos[PIN_TO_SERVO(pin)] = NULL;
   }
+  delete motions[PIN_TO_SERVO(pin)];
+  motions[PIN_TO_SERVO(pin)] = NULL;
+}
+
+void ServoFirmata::setMotionLimits(byte pin, int minPulse, int maxPulse, uint32_t maxVelocity, uint32_t acceleration)
+{
+  servo_motion *motion = motions[PIN_TO_SERVO(pin)];
+  if (maxVelocity == 0) {
+    delete motion;
+    motions[PIN_TO_SERVO(pin)] = NULL;
+    return;
+  }
+  if (!motion) {
+    motion = new servo_motion();
+    motions[PIN_TO_SERVO(pin)] = motion;
+  }
+  // The same defaults as Servo::attach()
+  motion->minPulse = minPulse > 0 ? minPulse : MIN_PULSE_WIDTH;
+  motion->maxPulse = maxPulse > 0 ? maxPulse : MAX_PULSE_WIDTH;
+  motion->maxVelocity = maxVelocity;
+  motion->acceleration = acceleration;
+  motion->moving = false;
+  motion->group = SERVO_NO_GROUP;
+}
+
+void ServoFirmata::defineGroup(byte argc, byte* argv)
+{
+  byte group = argv[1];
+  byte members = argc - 2;
+  if (members > SERVO_GROUP_MAX_MEMBERS) {
+    Firmata.sendString(F("Too many servos in group"));
+    return;
+  }
+  for (byte i = 0; i < members; i++) {
+    byte pin = argv[2 + i];
+    if (!IS_PIN_SERVO(pin) || PIN_TO_SERVO(pin) >= MAX_SERVOS || !motions[PIN_TO_SERVO(pin)]) {
+      Firmata.sendString(F("Servo group members need a speed limit"));
+      return;
+    }
+    groupMembers[group][i] = pin;
+  }
+  groupSize[group] = members;
+}
+
+/*
+ * Time to move the given distance from standstill to standstill
+ */
+static float servoTravelTime(float distance, float velocity, float acceleration)
+{
+  if (acceleration == 0) {
+    return distance / velocity;
+  }
+  if (distance >= velocity * velocity / acceleration) {
+    // accelerate, cruise at full speed and brake
+    return distance / velocity + velocity / acceleration;
+  }
+  return 2 * sqrt(distance / acceleration);
+}
+
+/*
+ * Cruise velocity to move the given distance in the given time, from standstill to standstill.
+ * The time must be at least the travel time with the given acceleration.
+ */
+static float servoCruiseVelocity(float distance, float time, float acceleration)
+{
+  if (time <= 0) {
+    return 0;
+  }
+  if (acceleration == 0) {
+    return distance / time;
+  }
+  // distance = velocity * time - velocity^2 / acceleration, the smaller root
+  float a = acceleration * time;
+  return (a - sqrt(max(a * a - 4 * acceleration * distance, 0.0f))) / 2;
+}
+
+void ServoFirmata::moveGroup(byte argc, byte* argv)
+{
+  byte group = argv[1];
+  if (groupSize[group] == 0 || argc < 2 + 2 * groupSize[group]) {
+    Firmata.sendString(F("Invalid servo group move"));
+    return;
+  }
+  // The members may have been detached since the group was defined
+  for (byte i = 0; i < groupSize[group]; i++) {
+    byte index = PIN_TO_SERVO(groupMembers[group][i]);
+    if (!servos[index] || !motions[index]) {
+      Firmata.sendString(F("Servo group members need a speed limit"));
+      return;
+    }
+  }
+
+  // The move takes as long as the member that needs the most time with its own limits
+  float groupTime = 0;
+  for (byte i = 0; i < groupSize[group]; i++) {
+    byte index = PIN_TO_SERVO(groupMembers[group][i]);
+    servo_motion *motion = motions[index];
+    if (!motion->moving) {
+      motion->position = servos[index]->readMicroseconds();
+      motion->velocity = 0;
+    }
+    motion->target = toMicroseconds(motion, Firmata.decodePackedUInt14(argv + 2 + 2 * i));
+    float distance = fabs(motion->target - motion->position);
+    groupTime = max(groupTime, servoTravelTime(distance, motion->maxVelocity, motion->acceleration));
+  }
+
+  // The others cruise slower, with their own acceleration, so they arrive at the same time.
+  // Members that are already moving keep their velocity, so they may arrive a bit off.
+  for (byte i = 0; i < groupSize[group]; i++) {
+    servo_motion *motion = motions[PIN_TO_SERVO(groupMembers[group][i])];
+    float distance = fabs(motion->target - motion->position);
+    float velocity = servoCruiseVelocity(distance, groupTime, motion->acceleration);
+    motion->moveVelocity = min(velocity, (float)motion->maxVelocity);
+    motion->moveAcceleration = motion->acceleration;
+    motion->group = group;
+    motion->moving = true;
+  }
+}
+
+void ServoFirmata::finishMotion(byte pin)
+{
+  servo_motion *motion = motions[PIN_TO_SERVO(pin)];
+  if (motion->group == SERVO_NO_GROUP) {
+    Firmata.startSysex();
+    Firmata.write(SERVO_MOTION_DATA);
+    Firmata.write(SERVO_MOTION_DONE);
+    Firmata.write(pin);
+    Firmata.sendPackedUInt14(motion->target);
+    Firmata.endSysex();
+    return;
+  }
+
+  byte group = motion->group;
+  motion->group = SERVO_NO_GROUP;
+  for (byte i = 0; i < groupSize[group]; i++) {
+    servo_motion *member = motions[PIN_TO_SERVO(groupMembers[group][i])];
+    if (member && member->moving && member->group == group) {
+      return;
+    }
+  }
+  Firmata.startSysex();
+  Firmata.write(SERVO_MOTION_DATA);
+  Firmata.write(SERVO_GROUP_DONE);
+  Firmata.write(group);
+  Firmata.endSysex();
+}
+
+/*
+ * Moves the servo one step towards its target: accelerate up to the maximum velocity and start braking
+ * when the distance left is the braking distance.
+ */
+void ServoFirmata::updateMotion(byte pin, float dt)
+{
+  servo_motion *motion = motions[PIN_TO_SERVO(pin)];
+  float distance = motion->target - motion->position;
+  float direction = distance >= 0 ? 1 : -1;
+  float maxVelocity = motion->moveVelocity;
+  float velocity = motion->velocity;
+  if (motion->moveAcceleration == 0) {
+    velocity = direction * maxVelocity;
+  } else {
+    float acceleration = motion->moveAcceleration;
+    float brakingDistance = velocity * velocity / (2 * acceleration);
+    if (velocity * direction > 0 && fabs(distance) <= brakingDistance) {
+      velocity -= direction * acceleration * dt;
+    } else if (velocity * direction > maxVelocity) {
+      // Faster than this move allows, e.g. after a group move was started: slow down to the limit
+      velocity -= direction * acceleration * dt;
+      if (velocity * direction < maxVelocity) {
+        velocity = direction * maxVelocity;
+      }
+    } else {
+      velocity += direction * acceleration * dt;
+      if (velocity * direction > maxVelocity) {
+        velocity = direction * maxVelocity;
+      }
+    }
+  }
+
+  float step = velocity * dt;
+  if (fabs(distance) < 1 || (step * direction > 0 && fabs(step) >= fabs(distance))) {
+    motion->position = motion->target;
+    motion->velocity = 0;
+    motion->moving = false;
+  } else {
+    motion->position += step;
+    motion->velocity = velocity;
+  }
+  servos[PIN_TO_SERVO(pin)]->writeMicroseconds((int)(motion->position + 0.5f));
+
+  if (!motion->moving) {
+    finishMotion(pin);
+  }
+}
+
+void ServoFirmata::report(bool elapsed)
+{
+  uint32_t now = millis();
+  uint32_t interval = now - lastMotionUpdate;
+  if (interval < SERVO_MOTION_INTERVAL) {
+    return;
+  }
+  lastMotionUpdate = now;
+  // Don't make up for a long pause in one step
+  float dt = min(interval, (uint32_t)(5 * SERVO_MOTION_INTERVAL)) / 1000.0f;
+  for (byte pin = 0; pin < TOTAL_PINS; pin++) {
+    if (IS_PIN_SERVO(pin) && PIN_TO_SERVO(pin) < MAX_SERVOS) {
+      servo_motion *motion = motions[PIN_TO_SERVO(pin)];
+      if (motion && motion->moving && servos[PIN_TO_SERVO(pin)]) {
+        updateMotion(pin, dt);
+      }
+    }
+  }
 }
 
 void ServoFirmata::reset()
@@ -152,6 +473,9 @@ void ServoFirmata::reset()
       detach(pin);
     }
   }
+  for (byte i = 0; i < SERVO_MAX_GROUPS; i++) {
+    groupSize[i] = 0;
+  }
 }
 
 #endif /* ServoFirmata_h */
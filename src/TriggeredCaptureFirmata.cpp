@@ -0,0 +1,294 @@
+/*
+  TriggeredCaptureFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "TriggeredCaptureFirmata.h"
+#include "Encoder7Bit.h"
+
+TriggeredCaptureFirmata::TriggeredCaptureFirmata()
+{
+  source = &defaultSource;
+  state = CaptureState::Idle;
+  numChannels = 0;
+  capacity = 0;
+  writeFrame = 0;
+  framesStored = 0;
+  preTrigger = 0;
+  postTrigger = 0;
+  postRemaining = 0;
+  preCaptured = 0;
+  triggerChannel = 0;
+  triggerMode = CAPTURE_TRIGGER_NONE;
+  triggerLevel = 0;
+  previousValue = -1;
+  triggerTime = 0;
+  lostFrames = 0;
+  uploadFrame = 0;
+}
+
+TriggeredCaptureFirmata::TriggeredCaptureFirmata(AnalogSampleSource* source)
+  : TriggeredCaptureFirmata()
+{
+  this->source = source;
+}
+
+void TriggeredCaptureFirmata::handleCapability(byte pin)
+{
+}
+
+boolean TriggeredCaptureFirmata::handlePinMode(byte pin, int mode)
+{
+  return false;
+}
+
+boolean TriggeredCaptureFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != CAPTURE_DATA || argc < 1)
+  {
+    return false;
+  }
+  switch (argv[0])
+  {
+    case CAPTURE_ARM:
+      arm(argc, argv);
+      return true;
+    case CAPTURE_FORCE:
+      if (state == CaptureState::Armed)
+      {
+        noInterrupts();
+        trigger();
+        interrupts();
+      }
+      return true;
+    case CAPTURE_ABORT:
+      stopSampling();
+      state = CaptureState::Idle;
+      return true;
+  }
+  return false;
+}
+
+void TriggeredCaptureFirmata::arm(byte argc, byte* argv)
+{
+  // subcommand, rate (5), pre (2), post (2), trigger channel, mode, level (2), at least one channel (2)
+  if (argc < 17 || (argc - 15) % 2 != 0 || (argc - 15) / 2 > ANALOG_SAMPLE_SOURCE_MAX_CHANNELS)
+  {
+    Firmata.sendString(F("Invalid capture request"));
+    return;
+  }
+  stopSampling();
+  state = CaptureState::Idle;
+
+  byte channels = (argc - 15) / 2;
+  byte pins[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+  for (byte ch = 0; ch < channels; ch++)
+  {
+    byte type = argv[15 + 2 * ch];
+    byte number = argv[16 + 2 * ch];
+    if (type == CAPTURE_CHANNEL_DIGITAL)
+    {
+      if (number >= TOTAL_PINS || !IS_PIN_DIGITAL(number) ||
+          (Firmata.getPinMode(number) != PIN_MODE_INPUT && Firmata.getPinMode(number) != PIN_MODE_PULLUP))
+      {
+        Firmata.sendString(F("Capture pin is not in input mode"));
+        return;
+      }
+      pins[ch] = number | SAMPLE_SOURCE_DIGITAL;
+      continue;
+    }
+    byte pin = 0;
+    while (pin < TOTAL_PINS && !(FIRMATA_IS_PIN_ANALOG(pin) && PIN_TO_ANALOG(pin) == number))
+    {
+      pin++;
+    }
+    if (pin == TOTAL_PINS || Firmata.getPinMode(pin) != PIN_MODE_ANALOG)
+    {
+      Firmata.sendString(F("Capture channel is not in analog mode"));
+      return;
+    }
+    pins[ch] = pin;
+  }
+
+  if (argv[11] > CAPTURE_TRIGGER_BOTH)
+  {
+    Firmata.sendString(F("Invalid capture trigger mode"));
+    return;
+  }
+
+  uint32_t framesPerSecond = Firmata.decodePackedUInt32(argv + 1);
+  numChannels = channels;
+  capacity = CAPTURE_BUFFER_SIZE / numChannels;
+  preTrigger = Firmata.decodePackedUInt14(argv + 6);
+  postTrigger = Firmata.decodePackedUInt14(argv + 8);
+  triggerChannel = argv[10];
+  triggerMode = argv[11];
+  triggerLevel = Firmata.decodePackedUInt14(argv + 12);
+  if (postTrigger == 0 || (uint32_t)preTrigger + postTrigger > capacity || triggerChannel >= numChannels)
+  {
+    Firmata.sendString(F("Capture does not fit into the buffer"));
+    return;
+  }
+  writeFrame = 0;
+  framesStored = 0;
+  postRemaining = 0;
+  preCaptured = 0;
+  previousValue = -1;
+  lostFrames = 0;
+  state = CaptureState::Armed;
+  if (!source->start(pins, numChannels, framesPerSecond, this))
+  {
+    state = CaptureState::Idle;
+    Firmata.sendString(F("Capture rate not supported"));
+  }
+}
+
+void TriggeredCaptureFirmata::trigger()
+{
+  preCaptured = framesStored < preTrigger ? framesStored : preTrigger;
+  postRemaining = postTrigger;
+  triggerTime = micros();
+  state = CaptureState::Triggered;
+}
+
+bool TriggeredCaptureFirmata::pushFrame(const uint16_t* values)
+{
+  if (state != CaptureState::Armed && state != CaptureState::Triggered)
+  {
+    return true;
+  }
+  if (state == CaptureState::Armed && framesStored >= preTrigger)
+  {
+    // Only look for the trigger once the pre-trigger part of the buffer is filled
+    int32_t value = values[triggerChannel];
+    bool rising = previousValue >= 0 && previousValue < triggerLevel && value >= triggerLevel;
+    bool falling = previousValue >= 0 && previousValue >= triggerLevel && value < triggerLevel;
+    if (((triggerMode & CAPTURE_TRIGGER_RISING) && rising) || ((triggerMode & CAPTURE_TRIGGER_FALLING) && falling))
+    {
+      trigger();
+    }
+  }
+  previousValue = values[triggerChannel];
+
+  uint16_t* frame = samples + writeFrame * numChannels;
+  for (byte ch = 0; ch < numChannels; ch++)
+  {
+    frame[ch] = values[ch];
+  }
+  writeFrame = writeFrame + 1 < capacity ? writeFrame + 1 : 0;
+  if (framesStored < capacity)
+  {
+    framesStored++;
+  }
+  if (state == CaptureState::Triggered && --postRemaining == 0)
+  {
+    state = CaptureState::Done;
+  }
+  return true;
+}
+
+void TriggeredCaptureFirmata::dropFrames(uint32_t count)
+{
+  if (state == CaptureState::Armed || state == CaptureState::Triggered)
+  {
+    lostFrames += count;
+  }
+}
+
+void TriggeredCaptureFirmata::stopSampling()
+{
+  if (state == CaptureState::Armed || state == CaptureState::Triggered || state == CaptureState::Done)
+  {
+    source->stop();
+  }
+}
+
+void TriggeredCaptureFirmata::sendDone()
+{
+  Firmata.startSysex();
+  Firmata.write(CAPTURE_DATA);
+  Firmata.write(CAPTURE_DONE);
+  Firmata.sendPackedUInt14(preCaptured + postTrigger);
+  Firmata.sendPackedUInt14(preCaptured);
+  Firmata.sendPackedUInt32(triggerTime);
+  Firmata.write(DEFAULT_ADC_RESOLUTION);
+  Firmata.write(numChannels);
+  Firmata.sendPackedUInt32(lostFrames);
+  Firmata.endSysex();
+}
+
+void TriggeredCaptureFirmata::sendBlock()
+{
+  uint16_t totalFrames = preCaptured + postTrigger;
+  uint16_t frames = CAPTURE_BLOCK_SAMPLES / numChannels;
+  if (frames == 0)
+  {
+    frames = 1;
+  }
+  if (frames > totalFrames - uploadFrame)
+  {
+    frames = totalFrames - uploadFrame;
+  }
+  // The capture ends with the frame before writeFrame
+  uint16_t index = (writeFrame + capacity - totalFrames + uploadFrame) % capacity;
+  Firmata.startSysex();
+  Firmata.write(CAPTURE_DATA);
+  Firmata.write(CAPTURE_BLOCK);
+  Firmata.sendPackedUInt14(uploadFrame);
+  Firmata.sendPackedUInt14(frames);
+  BitStreamEncoder encoder;
+  for (uint16_t i = 0; i < frames; i++)
+  {
+    uint16_t* frame = samples + index * numChannels;
+    for (byte ch = 0; ch < numChannels; ch++)
+    {
+      encoder.write(frame[ch], DEFAULT_ADC_RESOLUTION);
+    }
+    index = index + 1 < capacity ? index + 1 : 0;
+  }
+  encoder.flush();
+  Firmata.endSysex();
+  uploadFrame += frames;
+}
+
+void TriggeredCaptureFirmata::report(bool elapsed)
+{
+  switch (state)
+  {
+    case CaptureState::Armed:
+    case CaptureState::Triggered:
+      source->poll();
+      break;
+    case CaptureState::Done:
+      source->stop();
+      sendDone();
+      uploadFrame = 0;
+      state = CaptureState::Uploading;
+      break;
+    case CaptureState::Uploading:
+      for (byte i = 0; i < CAPTURE_BLOCKS_PER_LOOP && uploadFrame < preCaptured + postTrigger; i++)
+      {
+        sendBlock();
+      }
+      if (uploadFrame >= preCaptured + postTrigger)
+      {
+        state = CaptureState::Idle;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void TriggeredCaptureFirmata::reset()
+{
+  stopSampling();
+  state = CaptureState::Idle;
+}
@@ -0,0 +1,111 @@
+/*
+  TriggeredCaptureFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef TriggeredCaptureFirmata_h
+#define TriggeredCaptureFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "utility/AnalogSampleSource.h"
+
+// Subcommands of CAPTURE_DATA
+#define CAPTURE_ARM       0x00 // frames per second (packed 32 bit), pre-trigger frames (2 bytes), post-trigger frames (2 bytes),
+                               // trigger channel (index into the channel list), trigger mode, trigger level (2 bytes),
+                               // then for each channel its type (CAPTURE_CHANNEL_*) and number
+#define CAPTURE_FORCE     0x01 // trigger now
+#define CAPTURE_ABORT     0x02
+#define CAPTURE_DONE      0x03 // reply: number of frames (2 bytes), number of frames before the trigger (2 bytes), timestamp
+                               // of the trigger in microseconds (packed 32 bit), bits per sample, number of channels, frames
+                               // lost because sampling was late (packed 32 bit)
+#define CAPTURE_BLOCK     0x04 // reply: index of the first frame (2 bytes), number of frames (2 bytes), then the samples frame
+                               // by frame as a continuous bit stream (LSB first, 7 bits per byte)
+
+// Channel types
+#define CAPTURE_CHANNEL_ANALOG  0x00 // analog channel number, must be in PIN_MODE_ANALOG
+#define CAPTURE_CHANNEL_DIGITAL 0x01 // digital pin number, must be in PIN_MODE_INPUT or PIN_MODE_PULLUP. Samples are 0 or 1.
+
+// Trigger modes. The trigger channel crosses the trigger level when it was below and is now at or above it (rising)
+// or the other way round (falling).
+#define CAPTURE_TRIGGER_NONE    0x00 // only CAPTURE_FORCE triggers
+#define CAPTURE_TRIGGER_RISING  0x01
+#define CAPTURE_TRIGGER_FALLING 0x02
+#define CAPTURE_TRIGGER_BOTH    0x03
+
+// Size of the capture buffer, in samples (not frames)
+#ifndef CAPTURE_BUFFER_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define CAPTURE_BUFFER_SIZE 4096
+#else
+#define CAPTURE_BUFFER_SIZE 192
+#endif
+#endif
+#define CAPTURE_BLOCK_SAMPLES  32 // samples per CAPTURE_BLOCK message
+#define CAPTURE_BLOCKS_PER_LOOP 4 // to keep the main loop responsive during the upload
+
+/*
+ * Samples a set of analog and digital channels at a fixed rate into a circular buffer, like the pre-trigger
+ * buffer of an oscilloscope. When the trigger fires, the given number of post-trigger frames is added, then
+ * sampling stops and the frozen buffer is uploaded from report(). Sampling never sends anything itself.
+ * A capture is single-shot; send CAPTURE_ARM again for the next one.
+ */
+class TriggeredCaptureFirmata: public FirmataFeature, public AnalogSampleSink
+{
+  public:
+    TriggeredCaptureFirmata();
+    /* Use another sample source (e.g. a SyntheticSampleSource for tests) */
+    TriggeredCaptureFirmata(AnalogSampleSource* source);
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    void reset() override;
+    void report(bool elapsed) override;
+
+    bool pushFrame(const uint16_t* values) override;
+    void dropFrames(uint32_t count) override;
+
+  private:
+    enum class CaptureState : byte
+    {
+      Idle,
+      Armed,
+      Triggered,
+      Done,
+      Uploading
+    };
+
+    void arm(byte argc, byte* argv);
+    void trigger();
+    void stopSampling();
+    void sendDone();
+    void sendBlock();
+
+    LoopSampleSource defaultSource;
+    AnalogSampleSource* source;
+    uint16_t samples[CAPTURE_BUFFER_SIZE];
+    volatile CaptureState state;
+    byte numChannels;
+    uint16_t capacity;       // in frames
+    uint16_t writeFrame;     // where the next frame goes
+    uint16_t framesStored;   // up to capacity
+    uint16_t preTrigger;     // requested frames before the trigger
+    uint16_t postTrigger;    // frames from the trigger on
+    uint16_t postRemaining;
+    uint16_t preCaptured;    // actual frames before the trigger
+    byte triggerChannel;
+    byte triggerMode;
+    uint16_t triggerLevel;
+    int32_t previousValue;   // of the trigger channel, -1 if none
+    uint32_t triggerTime;
+    uint32_t lostFrames;
+    uint16_t uploadFrame;    // next frame to upload, relative to the first frame of the capture
+};
+
+#endif
@@ -0,0 +1,318 @@
+/*
+  WaveformFirmata.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include <ConfigurableFirmata.h>
+#include "WaveformFirmata.h"
+
+#ifdef WAVEFORM_TIMER
+#include "hal/ledc_ll.h"
+
+#define WAVEFORM_TIMER_LEAD 10 // microseconds from starting a channel to its first update
+
+static WaveformFirmata* WaveformFirmataInstance;
+
+static void ARDUINO_ISR_ATTR WaveformIsr()
+{
+  WaveformFirmataInstance->handleTimer();
+}
+
+/*
+ * Sets the duty of an LEDC channel like ledc_set_duty() and ledc_update_duty(), which can't be called
+ * from an interrupt handler.
+ */
+static void ARDUINO_ISR_ATTR writeLedcDuty(uint8_t channel, uint32_t duty)
+{
+  ledc_dev_t* hw = LEDC_LL_GET_HW();
+  ledc_mode_t mode = (ledc_mode_t)(channel / SOC_LEDC_CHANNEL_NUM);
+  ledc_channel_t ch = (ledc_channel_t)(channel % SOC_LEDC_CHANNEL_NUM);
+  ledc_ll_set_duty_int_part(hw, mode, ch, duty);
+  ledc_ll_set_duty_direction(hw, mode, ch, LEDC_DUTY_DIR_INCREASE);
+  ledc_ll_set_duty_num(hw, mode, ch, 1);
+  ledc_ll_set_duty_cycle(hw, mode, ch, 1);
+  ledc_ll_set_duty_scale(hw, mode, ch, 0);
+  ledc_ll_set_sig_out_en(hw, mode, ch, true);
+  ledc_ll_set_duty_start(hw, mode, ch, true);
+  if (mode == LEDC_LOW_SPEED_MODE)
+  {
+    ledc_ll_ls_channel_update(hw, mode, ch);
+  }
+}
+#endif
+
+WaveformFirmata::WaveformFirmata(AnalogOutputFirmata& analogOutput)
+  : analogOutput(analogOutput)
+{
+#ifdef WAVEFORM_TIMER
+  WaveformFirmataInstance = this;
+  timer = nullptr;
+#endif
+  reset();
+}
+
+void WaveformFirmata::handleCapability(byte pin)
+{
+  // The pins are used in PIN_MODE_PWM, which is reported by AnalogOutputFirmata
+}
+
+boolean WaveformFirmata::handlePinMode(byte pin, int mode)
+{
+  for (byte i = 0; i < WAVEFORM_MAX_CHANNELS; i++)
+  {
+    if (channels[i].pin == pin)
+    {
+      channels[i].running = false;
+    }
+  }
+  return false;
+}
+
+boolean WaveformFirmata::handleSysex(byte command, byte argc, byte* argv)
+{
+  if (command != WAVEFORM_DATA || argc < 2)
+  {
+    return false;
+  }
+  if (argv[1] >= WAVEFORM_MAX_CHANNELS)
+  {
+    Firmata.sendString(F("Invalid waveform channel"));
+    return true;
+  }
+  waveform_channel& channel = channels[argv[1]];
+  switch (argv[0])
+  {
+    case WAVEFORM_TABLE:
+      loadTable(argc, argv);
+      return true;
+    case WAVEFORM_START:
+      start(argc, argv);
+      return true;
+    case WAVEFORM_STOP:
+      channel.running = false;
+      return true;
+    case WAVEFORM_FREQUENCY:
+      if (argc < 7 || !setFrequency(channel, Firmata.decodePackedUInt32(argv + 2)))
+      {
+        Firmata.sendString(F("Invalid waveform frequency"));
+      }
+      return true;
+  }
+  return false;
+}
+
+void WaveformFirmata::loadTable(byte argc, byte* argv)
+{
+  byte bits = argc > 2 ? argv[2] : 0;
+  if (argc < 7 || (bits != 8 && bits != 16))
+  {
+    Firmata.sendString(F("Invalid waveform table"));
+    return;
+  }
+  waveform_channel& channel = channels[argv[1]];
+  uint16_t length = Firmata.decodePackedUInt14(argv + 3);
+  uint16_t index = Firmata.decodePackedUInt14(argv + 5);
+  if (length == 0 || length > WAVEFORM_TABLE_SIZE)
+  {
+    Firmata.sendString(F("Waveform table too long"));
+    return;
+  }
+  // Changing the length while playing would move the position in the waveform
+  if (channel.running && length != channel.length)
+  {
+    channel.running = false;
+  }
+  channel.length = length;
+
+  byte bytesPerSample = bits == 8 ? 2 : 3;
+  for (byte i = 7; i + bytesPerSample <= argc && index < length; i += bytesPerSample)
+  {
+    uint16_t sample = Firmata.decodePackedUInt14(argv + i);
+    if (bits == 16)
+    {
+      sample |= (uint16_t)argv[i + 2] << 14;
+    }
+    channel.table[index++] = sample;
+  }
+}
+
+void WaveformFirmata::start(byte argc, byte* argv)
+{
+  if (argc < 13)
+  {
+    Firmata.sendString(F("Invalid waveform request"));
+    return;
+  }
+  waveform_channel& channel = channels[argv[1]];
+  byte pin = argv[2];
+  uint32_t rate = Firmata.decodePackedUInt32(argv + 3);
+  if (pin >= TOTAL_PINS || Firmata.getPinMode(pin) != PIN_MODE_PWM || channel.length == 0)
+  {
+    Firmata.sendString(F("Waveform pin is not in PWM mode or no table loaded"));
+    return;
+  }
+  if (rate == 0 || rate > 1000000)
+  {
+    Firmata.sendString(F("Invalid waveform update rate"));
+    return;
+  }
+  channel.running = false;
+  channel.pin = pin;
+  channel.period = 1000000 / rate;
+  if (!setFrequency(channel, Firmata.decodePackedUInt32(argv + 8)))
+  {
+    Firmata.sendString(F("Invalid waveform frequency"));
+    return;
+  }
+  channel.phase = 0;
+#ifdef WAVEFORM_TIMER
+  if (!attachLedc(channel))
+  {
+    Firmata.sendString(F("Waveform pin has no PWM channel"));
+    return;
+  }
+  startTimer(channel);
+#else
+  channel.nextUpdate = micros();
+  channel.running = true;
+#endif
+}
+
+#ifdef WAVEFORM_TIMER
+bool WaveformFirmata::attachLedc(waveform_channel& channel)
+{
+  ledc_channel_handle_t* bus = (ledc_channel_handle_t*)perimanGetPinBus(channel.pin, ESP32_BUS_TYPE_LEDC);
+  if (bus == nullptr)
+  {
+    return false;
+  }
+  channel.ledcChannel = bus->channel;
+  channel.dutyMax = (1UL << bus->channel_resolution) - 1;
+  return true;
+}
+
+/*
+ * Starts the channel shortly from now. The alarm is set for this channel, the interrupt handler then
+ * sets it to the next update of all channels.
+ */
+void WaveformFirmata::startTimer(waveform_channel& channel)
+{
+  if (timer == nullptr)
+  {
+    timer = timerBegin(1000000);
+    timerAttachInterrupt(timer, WaveformIsr);
+  }
+  noInterrupts();
+  uint64_t alarm = timerRead(timer) + WAVEFORM_TIMER_LEAD;
+  channel.nextUpdate = (uint32_t)alarm;
+  channel.running = true;
+  timerAlarm(timer, alarm, false, 0);
+  interrupts();
+}
+#endif
+
+/*
+ * Writes the channels that are due and sets the alarm for the next update. The updates are on the schedule
+ * of each channel, so the latency of the interrupt doesn't add up.
+ */
+void WaveformFirmata::handleTimer()
+{
+#ifdef WAVEFORM_TIMER
+  uint64_t count = timerRead(timer);
+  uint32_t now = (uint32_t)count;
+  int32_t next = INT32_MAX;
+  for (byte i = 0; i < WAVEFORM_MAX_CHANNELS; i++)
+  {
+    waveform_channel& channel = channels[i];
+    if (!channel.running)
+    {
+      continue;
+    }
+    int32_t late = (int32_t)(now - channel.nextUpdate);
+    if (late >= 0)
+    {
+      // Skip the updates that were missed, so the waveform keeps its frequency
+      uint32_t updates = (uint32_t)late / channel.period;
+      channel.phase += channel.increment * updates;
+      channel.nextUpdate += channel.period * (updates + 1);
+
+      uint16_t index = (uint16_t)(((uint64_t)channel.phase * channel.length) >> 32);
+      uint32_t duty = channel.table[index];
+      writeLedcDuty(channel.ledcChannel, duty < channel.dutyMax ? duty : channel.dutyMax);
+      channel.phase += channel.increment;
+    }
+    int32_t wait = (int32_t)(channel.nextUpdate - now);
+    if (wait < next)
+    {
+      next = wait;
+    }
+  }
+  if (next != INT32_MAX)
+  {
+    timerAlarm(timer, count + next, false, 0);
+  }
+#endif
+}
+
+bool WaveformFirmata::setFrequency(waveform_channel& channel, uint32_t frequency)
+{
+  // Increment = frequency [mHz] * period [us] / 10^9 of a turn. At most one turn per update.
+  uint64_t product = (uint64_t)frequency * channel.period;
+  if (product >= 1000000000)
+  {
+    return false;
+  }
+  channel.increment = (uint32_t)((product << 32) / 1000000000);
+  return true;
+}
+
+void WaveformFirmata::report(bool elapsed)
+{
+#ifndef WAVEFORM_TIMER
+  uint32_t now = micros();
+  for (byte i = 0; i < WAVEFORM_MAX_CHANNELS; i++)
+  {
+    waveform_channel& channel = channels[i];
+    if (!channel.running)
+    {
+      continue;
+    }
+    uint32_t late = now - channel.nextUpdate;
+    if ((int32_t)late < 0)
+    {
+      continue;
+    }
+    // Skip the updates the loop has missed, so the waveform keeps its frequency
+    uint32_t updates = late / channel.period;
+    channel.phase += channel.increment * updates;
+    channel.nextUpdate += channel.period * (updates + 1);
+
+    uint16_t index = (uint16_t)(((uint64_t)channel.phase * channel.length) >> 32);
+    analogOutput.analogWriteInternal(channel.pin, channel.table[index]);
+    channel.phase += channel.increment;
+  }
+#endif
+}
+
+void WaveformFirmata::reset()
+{
+  for (byte i = 0; i < WAVEFORM_MAX_CHANNELS; i++)
+  {
+    channels[i].running = false;
+    channels[i].length = 0;
+    channels[i].pin = 0xFF;
+  }
+#ifdef WAVEFORM_TIMER
+  if (timer != nullptr)
+  {
+    timerEnd(timer);
+    timer = nullptr;
+  }
+#endif
+}
@@ -0,0 +1,98 @@
+/*
+  WaveformFirmata.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef WaveformFirmata_h
+#define WaveformFirmata_h
+
+#include <ConfigurableFirmata.h>
+#include "FirmataFeature.h"
+#include "AnalogOutputFirmata.h"
+
+// Subcommands of WAVEFORM_DATA
+#define WAVEFORM_TABLE     0x00 // channel, bits per sample (8 or 16), table length (2 bytes), index of the first sample (2 bytes),
+                                // then the samples (2 bytes each for 8 bits, 3 bytes each for 16 bits). The samples are duty values.
+#define WAVEFORM_START     0x01 // channel, pin, update rate in Hz (packed 32 bit), frequency of the waveform in mHz (packed 32 bit)
+#define WAVEFORM_STOP      0x02 // channel. The pin keeps the last sample.
+#define WAVEFORM_FREQUENCY 0x03 // channel, frequency of the waveform in mHz (packed 32 bit). The phase is kept.
+
+#ifndef WAVEFORM_MAX_CHANNELS
+#ifdef LARGE_MEM_DEVICE
+#define WAVEFORM_MAX_CHANNELS 4
+#else
+#define WAVEFORM_MAX_CHANNELS 2
+#endif
+#endif
+// Samples per channel
+#ifndef WAVEFORM_TABLE_SIZE
+#ifdef LARGE_MEM_DEVICE
+#define WAVEFORM_TABLE_SIZE   1024
+#else
+#define WAVEFORM_TABLE_SIZE   32
+#endif
+#endif
+
+// On the ESP32, the samples are written from a hardware timer interrupt, directly to the LEDC registers.
+// Not on the chips with the gamma fade hardware, which have another set of duty registers.
+#if defined(ESP32) && !defined(SOC_LEDC_GAMMA_CURVE_FADE_SUPPORTED)
+#define WAVEFORM_TIMER
+#endif
+
+struct waveform_channel {
+  uint16_t table[WAVEFORM_TABLE_SIZE];
+  uint16_t length;
+  byte pin;
+  bool running;
+  uint32_t period;      // between two updates, in microseconds
+  uint32_t nextUpdate;  // micros(), or the timer count with WAVEFORM_TIMER
+  uint32_t phase;       // position in the table, a full turn is 2^32
+  uint32_t increment;   // of the phase per update
+#ifdef WAVEFORM_TIMER
+  uint8_t ledcChannel;
+  uint32_t dutyMax;
+#endif
+};
+
+/*
+ * Plays sample tables on PWM pins. Each channel has its own table, which is played with a phase accumulator:
+ * the update rate sets how often the pin is written, the phase increment sets the frequency of the waveform,
+ * so it can be changed without a glitch and doesn't need to be a divisor of the update rate.
+ * On the ESP32 the pins are written from a hardware timer interrupt. Other boards write them from the main
+ * loop with AnalogOutputFirmata, which adds the loop latency as jitter. When an update is late, the phase
+ * advances by the missed updates, so the frequency stays exact. DAC pins are not supported.
+ */
+class WaveformFirmata: public FirmataFeature
+{
+  public:
+    WaveformFirmata(AnalogOutputFirmata& analogOutput);
+    void handleCapability(byte pin) override;
+    boolean handlePinMode(byte pin, int mode) override;
+    boolean handleSysex(byte command, byte argc, byte* argv) override;
+    void reset() override;
+    void report(bool elapsed) override;
+
+    void handleTimer();
+
+  private:
+    void loadTable(byte argc, byte* argv);
+    void start(byte argc, byte* argv);
+    bool setFrequency(waveform_channel& channel, uint32_t frequency);
+
+    AnalogOutputFirmata& analogOutput;
+    waveform_channel channels[WAVEFORM_MAX_CHANNELS];
+#ifdef WAVEFORM_TIMER
+    bool attachLedc(waveform_channel& channel);
+    void startTimer(waveform_channel& channel);
+
+    hw_timer_t* timer;
+#endif
+};
+
+#endif
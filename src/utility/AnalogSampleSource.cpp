@@ -0,0 +1,291 @@
+/*
+  AnalogSampleSource.cpp - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#include "AnalogSampleSource.h"
+
+LoopSampleSource::LoopSampleSource()
+{
+  numChannels = 0;
+  framesPerSecond = 0;
+  startTime = 0;
+  slot = 0;
+  frameNumber = 0;
+  sink = nullptr;
+}
+
+bool LoopSampleSource::start(const byte* pins, byte numChannels, uint32_t framesPerSecond, AnalogSampleSink* sink)
+{
+  if (numChannels == 0 || numChannels > ANALOG_SAMPLE_SOURCE_MAX_CHANNELS || framesPerSecond == 0 || framesPerSecond > 1000000)
+  {
+    return false;
+  }
+  memcpy(this->pins, pins, numChannels);
+  this->numChannels = numChannels;
+  this->framesPerSecond = framesPerSecond;
+  this->sink = sink;
+  slot = 0;
+  frameNumber = 0;
+  startTime = micros();
+  return true;
+}
+
+void LoopSampleSource::stop()
+{
+  sink = nullptr;
+}
+
+void LoopSampleSource::poll()
+{
+  if (sink == nullptr)
+  {
+    return;
+  }
+  // The slots are computed from the start time instead of adding up a rounded period, so the
+  // frames stay exactly on the grid n * 1000000 / framesPerSecond the receiver uses for the timestamps.
+  uint32_t elapsed = micros() - startTime;
+  uint32_t due = (uint32_t)((uint64_t)elapsed * framesPerSecond / 1000000);
+  if (due < slot)
+  {
+    return;
+  }
+  // Every slot that has passed since the last frame was missed
+  uint32_t late = due - slot;
+  if (late > 0)
+  {
+    sink->dropFrames(late);
+    frameNumber += late;
+  }
+  uint16_t values[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+  for (byte ch = 0; ch < numChannels; ch++)
+  {
+    values[ch] = sample(ch);
+  }
+  if (!sink->pushFrame(values))
+  {
+    sink->dropFrames(1);
+  }
+  frameNumber++;
+  slot = due + 1;
+  // Move the start time along, so that elapsed doesn't overflow
+  while (slot >= framesPerSecond)
+  {
+    slot -= framesPerSecond;
+    startTime += 1000000;
+  }
+}
+
+uint16_t LoopSampleSource::sample(byte channel)
+{
+  byte pin = pins[channel];
+  if (pin & SAMPLE_SOURCE_DIGITAL)
+  {
+    return digitalRead(PIN_TO_DIGITAL(pin & ~SAMPLE_SOURCE_DIGITAL)) == HIGH ? 1 : 0;
+  }
+  return analogRead(pin);
+}
+
+uint16_t SyntheticSampleSource::sample(byte channel)
+{
+  return (uint16_t)(frameNumber + 64 * channel) & ((1 << DEFAULT_ADC_RESOLUTION) - 1);
+}
+
+#ifdef ESP32
+
+#ifndef SOC_ADC_SAMPLE_FREQ_THRES_LOW
+#define SOC_ADC_SAMPLE_FREQ_THRES_LOW 20000
+#endif
+#ifndef SOC_ADC_SAMPLE_FREQ_THRES_HIGH
+#define SOC_ADC_SAMPLE_FREQ_THRES_HIGH 2000000
+#endif
+
+#if CONFIG_IDF_TARGET_ESP32 || CONFIG_IDF_TARGET_ESP32S2
+#define ADC_OUTPUT_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE1
+#define ADC_RESULT_CHANNEL(result) ((result)->type1.channel)
+#define ADC_RESULT_DATA(result) ((result)->type1.data)
+#else
+#define ADC_OUTPUT_FORMAT ADC_DIGI_OUTPUT_FORMAT_TYPE2
+#define ADC_RESULT_CHANNEL(result) ((result)->type2.channel)
+#define ADC_RESULT_DATA(result) ((result)->type2.data)
+#endif
+
+#define ADC_DMA_FRAME_BYTES 256  // conversion results per DMA transfer, times SOC_ADC_DIGI_RESULT_BYTES
+#define ADC_POOL_BYTES      8192 // results the driver keeps until poll() reads them
+
+Esp32ContinuousSampleSource::Esp32ContinuousSampleSource()
+{
+  handle = nullptr;
+  numChannels = 0;
+  conversionsPerFrame = 0;
+  poolOverflows = 0;
+  overflowsSeen = 0;
+  sink = nullptr;
+  clearFrame();
+}
+
+bool IRAM_ATTR Esp32ContinuousSampleSource::poolOverflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* data, void* source)
+{
+  Esp32ContinuousSampleSource* self = (Esp32ContinuousSampleSource*)source;
+  self->poolOverflows = self->poolOverflows + 1;
+  return false;
+}
+
+bool Esp32ContinuousSampleSource::start(const byte* pins, byte numChannels, uint32_t framesPerSecond, AnalogSampleSink* sink)
+{
+  if (handle != nullptr || numChannels == 0 || numChannels > ANALOG_SAMPLE_SOURCE_MAX_CHANNELS || framesPerSecond == 0)
+  {
+    return false;
+  }
+  uint32_t conversionsPerSecond = framesPerSecond * numChannels;
+  if (conversionsPerSecond > SOC_ADC_SAMPLE_FREQ_THRES_HIGH)
+  {
+    return false;
+  }
+  // Average conversionsPerPin conversions per frame, so that we stay above the minimum rate of the driver
+  uint32_t conversionsPerPin = (SOC_ADC_SAMPLE_FREQ_THRES_LOW + conversionsPerSecond - 1) / conversionsPerSecond;
+  if (conversionsPerPin == 0)
+  {
+    conversionsPerPin = 1;
+  }
+
+  memset(channelIndex, 0xFF, sizeof(channelIndex));
+  adc_digi_pattern_config_t pattern[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+  for (byte ch = 0; ch < numChannels; ch++)
+  {
+    adc_unit_t unit;
+    adc_channel_t channel;
+    if ((pins[ch] & SAMPLE_SOURCE_DIGITAL) || adc_continuous_io_to_channel(pins[ch], &unit, &channel) != ESP_OK ||
+        unit != ADC_UNIT_1 || channel >= ESP32_ADC_MAX_CHANNEL_ID)
+    {
+      return false;
+    }
+    channelIndex[channel] = ch;
+    pattern[ch].atten = ADC_ATTEN_DB_12; // same as analogRead()
+    pattern[ch].channel = channel;
+    pattern[ch].unit = unit;
+    pattern[ch].bit_width = SOC_ADC_DIGI_MAX_BITWIDTH;
+  }
+
+  adc_continuous_handle_cfg_t handleConfig = {};
+  handleConfig.max_store_buf_size = ADC_POOL_BYTES;
+  handleConfig.conv_frame_size = ADC_DMA_FRAME_BYTES;
+  adc_continuous_config_t config = {};
+  config.pattern_num = numChannels;
+  config.adc_pattern = pattern;
+  config.sample_freq_hz = conversionsPerSecond * conversionsPerPin;
+  config.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  config.format = ADC_OUTPUT_FORMAT;
+  adc_continuous_evt_cbs_t callbacks = {};
+  callbacks.on_pool_ovf = poolOverflow;
+  if (adc_continuous_new_handle(&handleConfig, &handle) != ESP_OK)
+  {
+    handle = nullptr;
+    return false;
+  }
+  if (adc_continuous_config(handle, &config) != ESP_OK ||
+      adc_continuous_register_event_callbacks(handle, &callbacks, this) != ESP_OK)
+  {
+    adc_continuous_deinit(handle);
+    handle = nullptr;
+    return false;
+  }
+
+  this->numChannels = numChannels;
+  this->sink = sink;
+  conversionsPerFrame = conversionsPerPin * numChannels;
+  overflowsSeen = poolOverflows;
+  clearFrame();
+  if (adc_continuous_start(handle) != ESP_OK)
+  {
+    adc_continuous_deinit(handle);
+    handle = nullptr;
+    this->sink = nullptr;
+    return false;
+  }
+  return true;
+}
+
+void Esp32ContinuousSampleSource::stop()
+{
+  if (handle != nullptr)
+  {
+    adc_continuous_stop(handle);
+    adc_continuous_deinit(handle);
+    handle = nullptr;
+  }
+  sink = nullptr;
+}
+
+void Esp32ContinuousSampleSource::clearFrame()
+{
+  memset(sums, 0, sizeof(sums));
+  memset(counts, 0, sizeof(counts));
+  conversionsInFrame = 0;
+}
+
+void Esp32ContinuousSampleSource::addConversion(byte channel, uint16_t value)
+{
+  if (channel >= ESP32_ADC_MAX_CHANNEL_ID || channelIndex[channel] == 0xFF)
+  {
+    return;
+  }
+  byte index = channelIndex[channel];
+  sums[index] += value;
+  counts[index]++;
+  if (++conversionsInFrame < conversionsPerFrame)
+  {
+    return;
+  }
+  uint16_t values[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+  for (byte ch = 0; ch < numChannels; ch++)
+  {
+    uint32_t mean = counts[ch] > 0 ? sums[ch] / counts[ch] : 0;
+#if SOC_ADC_DIGI_MAX_BITWIDTH > DEFAULT_ADC_RESOLUTION
+    mean >>= SOC_ADC_DIGI_MAX_BITWIDTH - DEFAULT_ADC_RESOLUTION;
+#endif
+    values[ch] = (uint16_t)mean;
+  }
+  if (!sink->pushFrame(values))
+  {
+    sink->dropFrames(1);
+  }
+  clearFrame();
+}
+
+void Esp32ContinuousSampleSource::poll()
+{
+  if (handle == nullptr)
+  {
+    return;
+  }
+  // Read everything the DMA has written since the last pass
+  uint8_t buffer[ADC_DMA_FRAME_BYTES];
+  uint32_t length = 0;
+  while (adc_continuous_read(handle, buffer, sizeof(buffer), &length, 0) == ESP_OK && length > 0)
+  {
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= length; i += SOC_ADC_DIGI_RESULT_BYTES)
+    {
+      const adc_digi_output_data_t* result = (const adc_digi_output_data_t*)&buffer[i];
+      addConversion(ADC_RESULT_CHANNEL(result), ADC_RESULT_DATA(result));
+    }
+  }
+
+  // The pool was full, the driver dropped whole DMA transfers. The frame in progress is incomplete, too.
+  uint32_t overflows = poolOverflows;
+  if (overflows != overflowsSeen)
+  {
+    uint32_t lost = (overflows - overflowsSeen) * (ADC_DMA_FRAME_BYTES / SOC_ADC_DIGI_RESULT_BYTES) + conversionsInFrame;
+    overflowsSeen = overflows;
+    sink->dropFrames((lost + conversionsPerFrame - 1) / conversionsPerFrame);
+    clearFrame();
+  }
+}
+
+#endif
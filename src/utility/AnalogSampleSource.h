@@ -0,0 +1,127 @@
+/*
+  AnalogSampleSource.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef AnalogSampleSource_h
+#define AnalogSampleSource_h
+
+#include <ConfigurableFirmata.h>
+
+#define ANALOG_SAMPLE_SOURCE_MAX_CHANNELS 8
+#define SAMPLE_SOURCE_DIGITAL 0x80 // or'ed to a pin number to sample the pin with digitalRead() instead
+
+/*
+ * Receives the samples of an AnalogSampleSource. A frame contains one sample per channel.
+ * Both methods may be called from an interrupt handler.
+ */
+class AnalogSampleSink
+{
+  public:
+    /* Returns false if the frame could not be stored. */
+    virtual bool pushFrame(const uint16_t* values) = 0;
+    /* Called by sources that detect that they missed frames. */
+    virtual void dropFrames(uint32_t count) = 0;
+    virtual ~AnalogSampleSink() = default;
+};
+
+/*
+ * Produces frames of analog samples at a fixed rate.
+ */
+class AnalogSampleSource
+{
+  public:
+    /* Starts sampling the given pins with the given number of frames per second. Returns false if that's not
+       supported, e.g. if a pin is marked with SAMPLE_SOURCE_DIGITAL and the source can't sample digital pins. */
+    virtual bool start(const byte* pins, byte numChannels, uint32_t framesPerSecond, AnalogSampleSink* sink) = 0;
+    virtual void stop() = 0;
+    /* Called from the main loop. Sources that are not interrupt driven produce their samples here. */
+    virtual void poll()
+    {
+    }
+    virtual ~AnalogSampleSource() = default;
+};
+
+/*
+ * Samples with analogRead() (or digitalRead()) from the main loop, on the schedule given by micros(). Frames
+ * that are missed because the loop was busy are reported to the sink as dropped. Works on every board.
+ */
+class LoopSampleSource : public AnalogSampleSource
+{
+  public:
+    LoopSampleSource();
+    bool start(const byte* pins, byte numChannels, uint32_t framesPerSecond, AnalogSampleSink* sink) override;
+    void stop() override;
+    void poll() override;
+
+  protected:
+    virtual uint16_t sample(byte channel);
+
+    byte pins[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+    byte numChannels;
+    uint32_t framesPerSecond;
+    uint32_t startTime; // micros() at slot 0
+    uint32_t slot;
+    uint32_t frameNumber; // frames produced or dropped since start
+    AnalogSampleSink* sink;
+};
+
+/*
+ * Produces a sawtooth on every channel instead of reading pins, with the same timing as LoopSampleSource.
+ * Sample n of channel c is (n + 64 * c) modulo 2^DEFAULT_ADC_RESOLUTION. Use this to test the
+ * streaming pipeline without analog hardware.
+ */
+class SyntheticSampleSource : public LoopSampleSource
+{
+  protected:
+    uint16_t sample(byte channel) override;
+};
+
+#ifdef ESP32
+#include "esp_adc/adc_continuous.h"
+
+#define ESP32_ADC_MAX_CHANNEL_ID 16 // channel numbers in the DMA results have 4 bits
+
+/*
+ * Uses the continuous ADC driver of the ESP32 (ADC1 pins only). The conversions are written by DMA into the
+ * pool of the driver, which is drained in poll(), so every frame reaches the sink as long as the loop comes
+ * around before the pool is full. The driver has a minimum conversion rate, lower frame rates are reached
+ * by averaging several conversions per frame.
+ */
+class Esp32ContinuousSampleSource : public AnalogSampleSource
+{
+  public:
+    Esp32ContinuousSampleSource();
+    bool start(const byte* pins, byte numChannels, uint32_t framesPerSecond, AnalogSampleSink* sink) override;
+    void stop() override;
+    void poll() override;
+
+  private:
+    static bool poolOverflow(adc_continuous_handle_t handle, const adc_continuous_evt_data_t* data, void* source);
+    void addConversion(byte channel, uint16_t value);
+    void clearFrame();
+
+    adc_continuous_handle_t handle;
+    byte numChannels;
+    byte channelIndex[ESP32_ADC_MAX_CHANNEL_ID]; // index in the frame of each ADC channel, 0xFF if not sampled
+    uint32_t sums[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+    uint16_t counts[ANALOG_SAMPLE_SOURCE_MAX_CHANNELS];
+    uint32_t conversionsPerFrame;
+    uint32_t conversionsInFrame;
+    volatile uint32_t poolOverflows; // DMA frames the driver had to drop, counted by poolOverflow()
+    uint32_t overflowsSeen;
+    AnalogSampleSink* sink;
+};
+
+typedef Esp32ContinuousSampleSource DefaultAnalogSampleSource;
+#else
+typedef LoopSampleSource DefaultAnalogSampleSource;
+#endif
+
+#endif /* AnalogSampleSource_h */
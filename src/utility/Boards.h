@@ -124,6 +124,9 @@ writePort(port, value, bitmask):  Write an 8 bit port.
    port:    The port number, Firmata pins port*8 to port*8+7
    value:   The 8 bit value to write
    bitmask: The actual pins to write, indicated by 1 bits.
+
+writePortRaw(port, value, bitmask):  Same as writePort, but the caller
+   must disable interrupts. Used to write several ports at once.
 */
 
 /*==============================================================================
@@ -704,6 +707,8 @@ writePort(port, value, bitmask):  Write an 8 bit port.
 // ESP32
 // GPIO 6-11 are used for FLASH I/O, therefore they're unavailable here
 #elif defined(ESP32)
+#include "soc/soc_caps.h"
+#include "soc/gpio_reg.h" // for direct port access in readPort() and writePort()
 #define TOTAL_ANALOG_PINS       20 /* Must be the largest Axx number, not NUM_ANALOG_INPUTS*/
 #define TOTAL_PINS              NUM_DIGITAL_PINS
 #if defined (ARDUINO_M5STACK_Core2) || defined (ARDUINO_M5STACK_TOUGH)
@@ -759,6 +764,7 @@ writePort(port, value, bitmask):  Write an 8 bit port.
 #elif defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)
 
 #include <stdarg.h>
+#include <hardware/structs/sio.h> // for direct port access in readPort() and writePort()
 
 static inline void attachInterrupt(pin_size_t interruptNumber, voidFuncPtr callback, int mode)
 {
@@ -860,6 +866,25 @@ static inline unsigned char readPort(byte port, byte bitmask)
   if (port == 1) return ((PINB & 0x3F) | ((PINC & 0x03) << 6)) & bitmask;
   if (port == 2) return ((PINC & 0x3C) >> 2) & bitmask;
   return 0;
+#elif defined(ESP32)
+  // Firmata pins are GPIO numbers, so each port is one byte of the GPIO input registers
+#if SOC_GPIO_PIN_COUNT > 32
+  if (port >= 4) return (unsigned char)(REG_READ(GPIO_IN1_REG) >> ((port - 4) * 8)) & bitmask;
+#endif
+  return (unsigned char)(REG_READ(GPIO_IN_REG) >> (port * 8)) & bitmask;
+#elif defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)
+  // Firmata pins are GPIO numbers, so each port is one byte of the SIO input register
+  return (unsigned char)(sio_hw->gpio_in >> (port * 8)) & bitmask;
+#elif defined(ARDUINO_ARCH_SAMD)
+  // The pins of a port are spread over the port groups, the variant's pin table tells where
+  unsigned char out = 0, pin = port * 8;
+  for (byte i = 0; i < 8; i++) {
+    if ((bitmask & (1 << i)) && pin + i < TOTAL_PINS) {
+      const PinDescription& desc = g_APinDescription[PIN_TO_DIGITAL(pin + i)];
+      if (desc.ulPort != NOT_A_PORT && (PORT->Group[desc.ulPort].IN.reg & (1ul << desc.ulPin))) out |= (1 << i);
+    }
+  }
+  return out;
 #else
   unsigned char out = 0, pin = port * 8;
   if (IS_PIN_DIGITAL(pin + 0) && (bitmask & 0x01) && digitalRead(PIN_TO_DIGITAL(pin + 0))) out |= 0x01;
@@ -875,36 +900,68 @@ static inline unsigned char readPort(byte port, byte bitmask)
 }
 
 /*==============================================================================
- * writePort() - Write an 8 bit port, only touch pins specified by a bitmask
+ * writePortRaw() - Write an 8 bit port, only touch pins specified by a bitmask.
+ * Interrupts must be disabled by the caller. Use this to update several
+ * ports inside a single critical section.
  *============================================================================*/
 
-static inline unsigned char writePort(byte, byte, byte) __attribute__((always_inline, unused));
-static inline unsigned char writePort(byte port, byte value, byte bitmask)
+static inline unsigned char writePortRaw(byte, byte, byte) __attribute__((always_inline, unused));
+static inline unsigned char writePortRaw(byte port, byte value, byte bitmask)
 {
 #if defined(ARDUINO_PINOUT_OPTIMIZE)
   if (port == 0) {
     bitmask = bitmask & 0xFC;  // do not touch Tx & Rx pins
     byte valD = value & bitmask;
     byte maskD = ~bitmask;
-    cli();
     PORTD = (PORTD & maskD) | valD;
-    sei();
   } else if (port == 1) {
     byte valB = (value & bitmask) & 0x3F;
     byte valC = (value & bitmask) >> 6;
     byte maskB = ~(bitmask & 0x3F);
     byte maskC = ~((bitmask & 0xC0) >> 6);
-    cli();
     PORTB = (PORTB & maskB) | valB;
     PORTC = (PORTC & maskC) | valC;
-    sei();
   } else if (port == 2) {
     bitmask = bitmask & 0x0F;
     byte valC = (value & bitmask) << 2;
     byte maskC = ~(bitmask << 2);
-    cli();
     PORTC = (PORTC & maskC) | valC;
-    sei();
+  }
+  return 1;
+#elif defined(ESP32)
+  uint32_t set = (uint32_t)(value & bitmask);
+  uint32_t clear = (uint32_t)(~value & bitmask);
+#if SOC_GPIO_PIN_COUNT > 32
+  if (port >= 4) {
+    REG_WRITE(GPIO_OUT1_W1TS_REG, set << ((port - 4) * 8));
+    REG_WRITE(GPIO_OUT1_W1TC_REG, clear << ((port - 4) * 8));
+    return 1;
+  }
+#endif
+  REG_WRITE(GPIO_OUT_W1TS_REG, set << (port * 8));
+  REG_WRITE(GPIO_OUT_W1TC_REG, clear << (port * 8));
+  return 1;
+#elif defined(TARGET_RP2040) || defined(TARGET_RASPBERRY_PI_PICO)
+  sio_hw->gpio_set = (uint32_t)(value & bitmask) << (port * 8);
+  sio_hw->gpio_clr = (uint32_t)(~value & bitmask) << (port * 8);
+  return 1;
+#elif defined(ARDUINO_ARCH_SAMD)
+  // Collect the changes per port group, then write each group once
+  const byte groups = sizeof(PORT->Group) / sizeof(PORT->Group[0]);
+  uint32_t set[groups] = { 0 };
+  uint32_t clear[groups] = { 0 };
+  byte pin = port * 8;
+  for (byte i = 0; i < 8; i++) {
+    if ((bitmask & (1 << i)) && pin + i < TOTAL_PINS) {
+      const PinDescription& desc = g_APinDescription[PIN_TO_DIGITAL(pin + i)];
+      if (desc.ulPort == NOT_A_PORT) continue;
+      if (value & (1 << i)) set[desc.ulPort] |= 1ul << desc.ulPin;
+      else clear[desc.ulPort] |= 1ul << desc.ulPin;
+    }
+  }
+  for (byte g = 0; g < groups; g++) {
+    if (set[g]) PORT->Group[g].OUTSET.reg = set[g];
+    if (clear[g]) PORT->Group[g].OUTCLR.reg = clear[g];
   }
   return 1;
 #else
@@ -921,6 +978,23 @@ static inline unsigned char writePort(byte port, byte value, byte bitmask)
 #endif
 }
 
+/*==============================================================================
+ * writePort() - Write an 8 bit port, only touch pins specified by a bitmask
+ *============================================================================*/
+
+static inline unsigned char writePort(byte, byte, byte) __attribute__((always_inline, unused));
+static inline unsigned char writePort(byte port, byte value, byte bitmask)
+{
+#if defined(ARDUINO_PINOUT_OPTIMIZE)
+  cli();
+  writePortRaw(port, value, bitmask);
+  sei();
+  return 1;
+#else
+  return writePortRaw(port, value, bitmask);
+#endif
+}
+
 
 #ifndef TOTAL_PORTS
 #define TOTAL_PORTS             ((TOTAL_PINS + 7) / 8)
@@ -0,0 +1,97 @@
+/*
+  SampleRingBuffer.h - Firmata library
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  See file LICENSE.txt for further informations on licensing terms.
+*/
+
+#ifndef SampleRingBuffer_h
+#define SampleRingBuffer_h
+
+#include <inttypes.h>
+
+// The indices must be written with a single store, so that the other side never sees a half-written value
+#ifdef ARDUINO_ARCH_AVR
+typedef uint8_t ring_index_t;
+#define RING_BUFFER_MAX_SIZE 256
+#else
+typedef uint16_t ring_index_t;
+#define RING_BUFFER_MAX_SIZE 32768
+#endif
+
+/*
+ * A fixed size ring buffer that is lock free for exactly one producer (i.e. an interrupt handler or
+ * a driver callback) and one consumer (the main loop). Only the producer writes the head index and only the
+ * consumer writes the tail index. SIZE must be a power of 2, one entry is always kept free.
+ */
+template<typename T, uint16_t SIZE>
+class SampleRingBuffer
+{
+    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of 2");
+    static_assert(SIZE <= RING_BUFFER_MAX_SIZE, "SIZE too large for ring_index_t");
+
+  public:
+    SampleRingBuffer()
+    {
+      head = 0;
+      tail = 0;
+    }
+
+    /* Number of entries that can be popped. */
+    uint16_t count() const
+    {
+      return (uint16_t)(head - tail) & (SIZE - 1);
+    }
+
+    /* Number of entries that can be pushed. */
+    uint16_t space() const
+    {
+      return SIZE - 1 - count();
+    }
+
+    /* Producer side. Returns false if the buffer is full. */
+    bool push(T value)
+    {
+      ring_index_t h = head;
+      ring_index_t next = (h + 1) & (SIZE - 1);
+      if (next == tail)
+      {
+        return false;
+      }
+      data[h] = value;
+      __sync_synchronize(); // the entry must be visible before the index moves
+      head = next;
+      return true;
+    }
+
+    /* Consumer side. Returns false if the buffer is empty. */
+    bool pop(T& value)
+    {
+      ring_index_t t = tail;
+      if (t == head)
+      {
+        return false;
+      }
+      value = data[t];
+      __sync_synchronize();
+      tail = (t + 1) & (SIZE - 1);
+      return true;
+    }
+
+    /* Consumer side. Drops all entries currently in the buffer. */
+    void clear()
+    {
+      tail = head;
+    }
+
+  private:
+    T data[SIZE];
+    volatile ring_index_t head;
+    volatile ring_index_t tail;
+};
+
+#endif /* SampleRingBuffer_h */